@@ -0,0 +1,179 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "project.h"
+#include "keymap.h"
+#include "wheel.h"
+#include "combo.h"
+
+#define WORDS KEYMAP_PRESENT_WORDS
+
+static const struct combo* combos;
+static uint8 num_combos;
+static combo_post_t* post;
+static struct wheel_timer term_timer;
+static volatile bool term_up;
+
+/* members is every key in any combo. The keys being held back are both in
+ * pending, as a set, and in order, in the order they were pressed. Keys
+ * which went to make up a combo are in consumed until they're released;
+ * active is the set of combos currently pressed. */
+
+static union combo_keys members;
+static union combo_keys pending;
+static union combo_keys consumed;
+static uint8 order[COMBO_MAX_KEYS];
+static uint8 num_pending;
+static uint32 active[COMBO_MAX / 32];
+
+static void term_expired(struct wheel_timer* timer);
+
+void combo_init(const struct combo* c, uint8 count, combo_post_t* p)
+{
+    combos = c;
+    num_combos = (count > COMBO_MAX) ? COMBO_MAX : count;
+    post = p;
+    wheel_init(&term_timer, term_expired);
+
+    for (int i=0; i<num_combos; i++)
+        for (int w=0; w<WORDS; w++)
+            members.words[w] |= combos[i].keys.words[w];
+}
+
+uint8 combo_used(uint8 row)
+{
+    return members.rows[row];
+}
+
+uint8 combo_action(uint8 n)
+{
+    return (n < num_combos) ? combos[n].action : 0;
+}
+
+static void flush(void)
+{
+    wheel_stop(&term_timer);
+    for (int i=0; i<num_pending; i++)
+        post(order[i], true);
+    for (int w=0; w<WORDS; w++)
+        pending.words[w] = 0;
+    num_pending = 0;
+}
+
+static void fire(uint8 n)
+{
+    wheel_stop(&term_timer);
+    for (int w=0; w<WORDS; w++)
+    {
+        consumed.words[w] |= pending.words[w];
+        pending.words[w] = 0;
+    }
+    num_pending = 0;
+    active[n >> 5] |= 1UL << (n & 31);
+    post(KEYMAP_POSITIONS + n, true);
+}
+
+/* Compares the pending keys against every combo. A combo is still possible
+ * if the pending keys are a subset of its keys. If waiting can't change the
+ * answer, or final is set, it's settled now. */
+
+static void match(bool final)
+{
+    int exact = -1;
+    bool possible = false;
+
+    for (int i=0; i<num_combos; i++)
+    {
+        const uint32* keys = combos[i].keys.words;
+        uint32 outside = 0;
+        uint32 missing = 0;
+        for (int w=0; w<WORDS; w++)
+        {
+            outside |= pending.words[w] & ~keys[w];
+            missing |= keys[w] & ~pending.words[w];
+        }
+        if (outside)
+            continue;
+        if (missing)
+            possible = true;
+        else
+            exact = i;
+    }
+
+    if (possible && !final)
+        return;
+    if (exact >= 0)
+        fire(exact);
+    else
+        flush();
+}
+
+static void term_expired(struct wheel_timer* timer)
+{
+    term_up = true;
+}
+
+void combo_poll(void)
+{
+    if (!term_up)
+        return;
+    term_up = false;
+    if (num_pending)
+        match(true);
+}
+
+static void release_combos(uint8 word, uint32 bit)
+{
+    for (int i=0; i<num_combos; i++)
+    {
+        uint32 a = 1UL << (i & 31);
+        if ((active[i >> 5] & a) && (combos[i].keys.words[word] & bit))
+        {
+            active[i >> 5] &= ~a;
+            post(KEYMAP_POSITIONS + i, false);
+        }
+    }
+}
+
+void combo_event(uint8 position, bool pressed)
+{
+    uint8 word = position >> 5;
+    uint32 bit = 1UL << (position & 31);
+
+    if (!(members.words[word] & bit))
+    {
+        if (pressed && num_pending)
+            match(true);
+        post(position, pressed);
+        return;
+    }
+
+    if (pressed)
+    {
+        if (num_pending == COMBO_MAX_KEYS)
+            flush();
+        if (!num_pending)
+        {
+            term_up = false;
+            wheel_start(&term_timer, COMBO_TERM_MS);
+        }
+        pending.words[word] |= bit;
+        order[num_pending++] = position;
+        match(false);
+        return;
+    }
+
+    if (pending.words[word] & bit)
+        match(true);
+
+    if (consumed.words[word] & bit)
+    {
+        consumed.words[word] &= ~bit;
+        release_combos(word, bit);
+    }
+    else
+        post(position, false);
+}
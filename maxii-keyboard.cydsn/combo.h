@@ -0,0 +1,65 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef COMBO_H
+#define COMBO_H
+
+/* Combos: a set of keys pressed together, within COMBO_TERM_MS of the
+ * first, acts as a single extra key. Key sets are bitsets of keymap
+ * positions, laid out like a keymap overlay's presence bitmap, so the keys
+ * held down can be compared against every combo a word at a time.
+ *
+ * This sits between the debouncer and the event queue, in the scanner's
+ * context. Keys which aren't in any combo are passed straight through. A
+ * key which is in one is held back until it's clear whether a combo is
+ * happening, which is as soon as the keys held back match exactly one
+ * combo, or can't be the start of any, or a key is released, or another
+ * key is pressed, or COMBO_TERM_MS is up. If not, the held-back keys are
+ * passed on in the order they were pressed. Matching only happens when a
+ * combo key is pressed, and costs a few instructions per combo. The timer
+ * wheel can't call back into the scanner's context, so the scanner has to
+ * call combo_poll() often (ideally once a millisecond) for COMBO_TERM_MS to
+ * be kept to. */
+
+#define COMBO_MAX 128
+#define COMBO_MAX_KEYS 8
+#define COMBO_TERM_MS 30
+
+union combo_keys
+{
+    uint8 rows[KEYMAP_PRESENT_WORDS * 4];
+    uint32 words[KEYMAP_PRESENT_WORDS];
+};
+
+/* action is a keycode. */
+
+struct combo
+{
+    union combo_keys keys;
+    uint8 action;
+};
+
+/* Combo n is reported to post as position KEYMAP_POSITIONS+n. */
+
+typedef void combo_post_t(uint8 position, bool pressed);
+
+extern void combo_init(const struct combo* combos, uint8 count, combo_post_t* post);
+
+/* Returns a mask of the keys in this row which are in any combo. */
+
+extern uint8 combo_used(uint8 row);
+
+/* Feeds in a debounced key change. */
+
+extern void combo_event(uint8 position, bool pressed);
+
+/* Acts on COMBO_TERM_MS running out; called from the scanner. */
+
+extern void combo_poll(void);
+
+/* Returns the action for combo n. */
+
+extern uint8 combo_action(uint8 n);
+
+#endif
@@ -0,0 +1,112 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "project.h"
+#include "eventlog.h"
+
+/* A single-producer, single-consumer ring: head is only written by
+ * eventlog_put() (which locks, so there can be several callers) and tail
+ * only by eventlog_drain(). offset is how much of the record at tail has
+ * already gone out. */
+
+static struct eventlog_record ring[EVENTLOG_ENTRIES];
+static volatile uint8 head;
+static volatile uint8 tail;
+static uint8 offset;
+static uint16 dropped;
+static volatile uint16 now;
+static volatile bool enabled;
+
+void eventlog_enable(bool e)
+{
+    enabled = e;
+}
+
+bool eventlog_enabled(void)
+{
+    return enabled;
+}
+
+void eventlog_tick(void)
+{
+    now++;
+}
+
+static uint8 space(void)
+{
+    return (tail - head - 1) & (EVENTLOG_ENTRIES-1);
+}
+
+static void put(uint8 type, uint8 arg, uint16 value)
+{
+    struct eventlog_record* r = &ring[head];
+    r->sync = EVENTLOG_SYNC;
+    r->type = type;
+    r->arg = arg;
+    r->check = 0;
+    r->value = value;
+    r->time = now;
+
+    const uint8* p = (const uint8*) r;
+    uint8 sum = 0;
+    for (unsigned i=0; i<sizeof(*r); i++)
+        sum += p[i];
+    r->check = -sum;
+
+    __DMB();
+    head = (head+1) & (EVENTLOG_ENTRIES-1);
+}
+
+void eventlog_put(uint8 type, uint8 arg, uint16 value)
+{
+    if (!enabled)
+        return;
+
+    uint8 state = CyEnterCriticalSection();
+    if (space() < (dropped ? 2 : 1))
+    {
+        if (dropped < UINT16_MAX)
+            dropped++;
+    }
+    else
+    {
+        if (dropped)
+        {
+            put(EVENTLOG_DROPPED, 0, dropped);
+            dropped = 0;
+        }
+        put(type, arg, value);
+    }
+    CyExitCriticalSection(state);
+}
+
+static void send_byte(void)
+{
+    __DMB();
+    const uint8* p = (const uint8*) &ring[tail];
+    UART_WriteTxData(p[offset++]);
+    if (offset == sizeof(struct eventlog_record))
+    {
+        offset = 0;
+        __DMB();
+        tail = (tail+1) & (EVENTLOG_ENTRIES-1);
+    }
+}
+
+void eventlog_drain(void)
+{
+    while ((tail != head) && (UART_ReadTxStatus() & UART_TX_STS_FIFO_NOT_FULL))
+        send_byte();
+}
+
+void eventlog_finish(void)
+{
+    while (offset)
+    {
+        if (UART_ReadTxStatus() & UART_TX_STS_FIFO_NOT_FULL)
+            send_byte();
+    }
+}
@@ -0,0 +1,65 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+/* A binary debug log. Records are fixed size, and putting one is a copy into
+ * a ring in RAM, so it's cheap enough for the report path; eventlog_drain()
+ * moves them out to the UART a byte at a time, only while the TX FIFO has
+ * room, so nothing ever waits on the serial port. If the ring fills up,
+ * because the log is being written faster than the UART can send it,
+ * records are dropped and counted, and an EVENTLOG_DROPPED record saying how
+ * many goes out once there's room again. The log is off until enabled.
+ *
+ * The records are interleaved with whatever else goes out of the UART, so
+ * each starts with EVENTLOG_SYNC and carries a checksum, which lets the
+ * decoder (tools/logdecode.py) pick them out of the text. Other output
+ * calls eventlog_finish() first, so it can only come between records,
+ * never in the middle of one. All fields are little-endian. */
+
+#define EVENTLOG_ENTRIES 64
+#define EVENTLOG_SYNC 0xa5
+
+enum
+{
+    EVENTLOG_DROPPED,           /* value: records lost */
+    EVENTLOG_EVENT,             /* arg: keymap position; value: 1 if pressed */
+    EVENTLOG_OUTPUT,            /* value: keymap output (see keymap.h) */
+    EVENTLOG_REPORT             /* arg: modifiers; value: report length */
+};
+
+struct eventlog_record
+{
+    uint8 sync;                 /* EVENTLOG_SYNC */
+    uint8 type;
+    uint8 arg;
+    uint8 check;                /* makes the record's bytes sum to zero */
+    uint16 value;
+    uint16 time;                /* milliseconds, wrapping */
+};
+
+extern void eventlog_enable(bool enabled);
+extern bool eventlog_enabled(void);
+
+/* Called once a millisecond to keep the timestamps going. */
+
+extern void eventlog_tick(void);
+
+/* Queues a record; safe from any context. */
+
+extern void eventlog_put(uint8 type, uint8 arg, uint16 value);
+
+/* Sends as much as the UART will take without blocking. Called from the
+ * main loop, which also owns the rest of the UART output. */
+
+extern void eventlog_drain(void);
+
+/* Sends the rest of a record which has only partly gone out, waiting for
+ * the UART if need be (at most a record's worth). Called from the main loop
+ * before anything else is written to the UART. */
+
+extern void eventlog_finish(void);
+
+#endif
@@ -0,0 +1,46 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "frame.h"
+
+/* Both the Cortex-M3 and anything this is likely to be tested on are little
+ * endian, so row n is byte n%4 of word n/4, counting from the bottom. */
+
+uint16_t frame_diff(const union frame* a, const union frame* b)
+{
+    uint16_t mask = 0;
+    for (int w=0; w<FRAME_WORDS; w++)
+    {
+        uint32_t x = a->words[w] ^ b->words[w];
+        if (!x)
+            continue;
+
+        for (int i=0; i<4; i++)
+        {
+            if (x & (0xffU << (i*8)))
+                mask |= 1 << (w*4 + i);
+        }
+    }
+    return mask & ((1 << FRAME_ROWS) - 1);
+}
+
+bool frame_ghosted(const union frame* f, uint8_t matrix_rows)
+{
+    for (int y1=0; y1<matrix_rows; y1++)
+    {
+        uint8_t row = f->rows[y1];
+        if (!(row & (row - 1)))
+            continue;
+
+        for (int y2=y1+1; y2<matrix_rows; y2++)
+        {
+            uint8_t shared = row & f->rows[y2];
+            if (shared & (shared - 1))
+                return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,32 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+/* A frame is one complete sample of the keyboard: a byte of sense lines for
+ * each of the nine probe lines plus the modifier register, padded out to a
+ * whole number of words so that frames can be compared a word at a time.
+ * This file has no hardware dependencies. */
+
+#define FRAME_ROWS 10
+#define FRAME_WORDS ((FRAME_ROWS + 3) / 4)
+
+union frame
+{
+    uint8_t rows[FRAME_WORDS * 4];
+    uint32_t words[FRAME_WORDS];
+};
+
+/* Returns a mask with bit n set if row n differs between the two frames. */
+
+extern uint16_t frame_diff(const union frame* a, const union frame* b);
+
+/* Returns true if any two of the first matrix_rows rows share two or more
+ * columns. On an undioded matrix that is exactly when a phantom key may be
+ * showing at the fourth corner of a rectangle. */
+
+extern bool frame_ghosted(const union frame* f, uint8_t matrix_rows);
+
+#endif
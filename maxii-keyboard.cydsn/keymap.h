@@ -0,0 +1,121 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+/* Rows in the keymap: the nine probe lines plus the modifier register. */
+
+#define KEYMAP_ROWS 10
+#define KEYMAP_POSITIONS (KEYMAP_ROWS * 8)
+#define KEYMAP_MAX_LAYERS 8
+
+/* Keymap entries are either HID usages or one of these actions, which live
+ * in the part of the usage space reserved by the HID spec. 0 means that the
+ * key does nothing on this layer. */
+
+#define KEY_Trans 0xe8               /* use the entry from the layer below */
+#define TAP_HOLD(n) (0xec | (n))     /* tap-hold key n; see below */
+#define LAYER_MO(n) (0xf0 | (n))     /* layer n is active while held */
+#define LAYER_TG(n) (0xf8 | (n))     /* toggles layer n */
+
+#define KEYMAP_MAX_TAPHOLDS 4
+
+/* A tap-hold key does one thing when tapped and another when held. It's a
+ * tap if it's released within KEYMAP_TAPPING_MS and nothing else is pressed
+ * in the meantime. Pressing another key makes it a hold straight away, so
+ * the other key gets the hold's layer or modifier with no delay; otherwise
+ * it becomes a hold once KEYMAP_TAPPING_MS is up. Either action may be a
+ * keycode or LAYER_MO(n); tapping a LAYER_MO(n) makes layer n a one-shot
+ * layer, active for the next key pressed only. */
+
+#define KEYMAP_TAPPING_MS 200
+
+struct keymap_taphold
+{
+    uint8 tap;
+    uint8 hold;
+};
+
+/* The base layer is stored in full. */
+
+typedef uint8 keymap_layer_t[KEYMAP_ROWS][8];
+
+/* The layers above it are mostly empty, so they are stored sparsely: bit
+ * n of present->rows[row] says whether column n has an entry, and actions
+ * holds just the entries which are present, in position order. count must
+ * be the number of entries (and is checked). Positions with no entry are
+ * KEY_Trans if transparent is set, and 0 otherwise. The presence bitmap is
+ * also readable a word at a time, so any entry can be found with at most
+ * KEYMAP_PRESENT_WORDS popcounts. Nothing is copied, so all of this can be
+ * read straight out of flash. */
+
+#define KEYMAP_PRESENT_WORDS ((KEYMAP_ROWS + 3) / 4)
+
+union keymap_present
+{
+    uint8 rows[KEYMAP_PRESENT_WORDS * 4];
+    uint32 words[KEYMAP_PRESENT_WORDS];
+};
+
+struct keymap_overlay
+{
+    const union keymap_present* present;
+    const uint8* actions;
+    uint8 count;
+    bool transparent;
+};
+
+/* Layer 0 is the base layer and is always active; layer n is
+ * overlays[n-1]. TAP_HOLD(n) refers to tapholds[n]. */
+
+extern void keymap_init(const keymap_layer_t* base,
+    const struct keymap_overlay* overlays, uint8 overlay_count,
+    const struct keymap_taphold* tapholds, uint8 taphold_count);
+
+/* Switches to another keymap, which is checked in the same way. The switch
+ * happens at the first key press with nothing else held down, so that
+ * every held key is released by the keymap which pressed it; until then
+ * keymap_replacing() returns true, and everything passed in must be left
+ * alone. Called from the main loop. */
+
+extern void keymap_replace(const keymap_layer_t* base,
+    const struct keymap_overlay* overlays, uint8 overlay_count,
+    const struct keymap_taphold* tapholds, uint8 taphold_count);
+extern bool keymap_replacing(void);
+
+/* Returns a mask of the keys in this row which are mapped on any layer. */
+
+extern uint8 keymap_used(uint8 row);
+
+/* The keymap's output is a list of keycodes to press, or to release if
+ * KEYMAP_RELEASE is set. */
+
+#define KEYMAP_RELEASE 0x100
+#define KEYMAP_MAX_OUTPUT 2
+
+/* Handles a key event, writing up to KEYMAP_MAX_OUTPUT keycode changes to
+ * output and returning how many there are. Releases always undo whatever
+ * the press did, whatever has happened to the layers in the meantime. */
+
+extern uint8 keymap_event(uint8 position, bool pressed, uint16* output);
+
+/* The same, for a key which isn't in the keymap (a combo) and always does
+ * action, a plain keycode. It counts as a key like any other: pressing it
+ * makes an undecided tap-hold key a hold, and a replacement keymap waits
+ * for it to be released. Every press must be matched by a release. */
+
+extern uint8 keymap_action_event(uint8 action, bool pressed, uint16* output);
+
+/* Tap-hold keys also produce output by themselves: the release half of a
+ * tap, and the hold once the tapping time is up. If keymap_pending()
+ * returns true, no more events should be handled until keymap_poll() has
+ * been called, and keymap_poll() should only be called once the report
+ * containing any earlier output has been sent, so that a tap's press and
+ * release go to the host separately. */
+
+extern bool keymap_pending(void);
+extern uint8 keymap_poll(uint16* output);
+
+#endif
@@ -0,0 +1,63 @@
+/* Generated by tools/keymapc.py from layout.txt and wiring.txt.
+ * Don't edit this; edit those and rebuild. */
+
+#if KEYMAP_ROWS != 10
+#error "the wiring doesn't match KEYMAP_ROWS"
+#endif
+
+/* Layer 0, Base. */
+
+static const keymap_layer_t base_layer = {
+    { KEY_9, KEY_0, KEY_LeftBracket, KEY_Quote, 0, KEY_P, KEY_Semicolon, KEY_Slash },
+    { KEY_8, KEY_Minus, KEY_RightBracket, KEY_NonUSHash, 0, KEY_O, KEY_L, KEY_Period },
+    { KEY_7, KEY_Equals, KEY_Insert, KEY_Grave, KEY_4, KEY_I, KEY_K, KEY_Comma },
+    { KEY_6, KEY_NonUSBackslash, KEY_Enter, LAYER_MO(1), KEY_5, KEY_U, KEY_J, KEY_M },
+    { 0, 0, 0, KEY_LeftAlt, KEY_Escape, KEY_Q, KEY_A, KEY_Z },
+    { KEY_G, KEY_H, 0, KEY_Menu, KEY_1, KEY_W, KEY_S, KEY_X },
+    { KEY_T, KEY_B, 0, KEY_Space, KEY_2, KEY_E, KEY_D, KEY_C },
+    { KEY_Y, KEY_N, 0, KEY_LeftGUI, KEY_3, KEY_R, KEY_F, KEY_V },
+    { 0, KEY_Delete, KEY_Enter, KEY_RightAlt, 0, 0, 0, 0 },
+    { KEY_LeftShift, KEY_Tab, KEY_LeftAlt, KEY_CapsLock, 0, 0, 0, 0 }
+};
+
+/* Layer 1, Magic: opaque, 27 entries. */
+
+static const uint8_t magic_actions[] = {
+    KEY_F9, KEY_F10,
+    KEY_F8, KEY_F11,
+    KEY_F7, KEY_F12, KEY_F4,
+    KEY_F6, KEY_Trans, KEY_F5,
+    KEY_Trans, KEY_Home, KEY_Left,
+    KEY_Trans, KEY_F1, KEY_Up, KEY_Down,
+    KEY_F2, KEY_End, KEY_Right,
+    KEY_Trans, KEY_F3, KEY_PageUp, KEY_PageDown,
+    KEY_Trans,
+    KEY_Trans, KEY_Trans,
+};
+
+static const union keymap_present magic_present = {
+    .rows = { 0x03, 0x03, 0x13, 0x19, 0x68, 0x78, 0x70, 0x78, 0x08, 0x05, 0x00, 0x00 }
+};
+
+#define NUM_OVERLAYS 1
+
+static const struct keymap_overlay overlays[1] = {
+    {
+        .present = &magic_present,
+        .actions = magic_actions,
+        .count = 27,
+        .transparent = false
+    }
+};
+
+#define NUM_TAPHOLDS 0
+
+static const struct keymap_taphold tapholds[1] = {
+    { 0 }
+};
+
+#define NUM_COMBOS 0
+
+static const struct combo combos[1] = {
+    { .action = 0 }
+};
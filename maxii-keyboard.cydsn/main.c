@@ -1,229 +1,812 @@
-/* maxii-keyboard firmware
- * (C) 2017 David Given
- */
-
-#include <stdio.h>
-#include <stdint.h>
-#include <stdbool.h>
-#include "project.h"
-#include "usbkeycodes.h"
-
-#define KEY_Magic 255
-#define QUEUE_SIZE 32
-
-struct queue_entry
-{
-    uint8 keycode;
-    bool pressed;
-};
-
-static struct queue_entry queue[QUEUE_SIZE];
-static volatile int readptr = 0;
-static volatile int writeptr = 0;
-static uint8 modifiers;
-
-static uint8 Keyboard_Data[8] = {};
-
-static void post_keyevent(uint8 keycode, bool pressed)
-{
-    if (writeptr != ((readptr-1) & (QUEUE_SIZE-1)))
-    {
-        struct queue_entry* entry = &queue[writeptr];
-        entry->keycode = keycode;
-        entry->pressed = pressed;
-        
-        writeptr = (writeptr+1) & (QUEUE_SIZE-1);
-    }
-    else
-        LedReg_Write(true);
-}
-
-static void read_modifiers(void)
-{
-    static const uint8 keycodes[8] = {
-        KEY_LeftShift,
-        KEY_Tab, 
-        KEY_LeftAlt, 
-        KEY_CapsLock, 
-        0, 
-        0, 
-        0, 
-        0
-    };
-    
-    static uint8 oldsense = 0;
-    uint8 sense = ~ModifierReg_Read(); /* active high */
-    uint8 changed = sense ^ oldsense;
-    
-    for (int y=0; y<8; y++)
-    {
-        if (changed & (1<<y))
-        {
-            uint8 keycode = keycodes[y];
-            if (keycode)
-                post_keyevent(keycode, sense & (1<<y));
-        }
-    }
-    
-    oldsense = sense;
-}
-
-static uint8 alt_keycode(uint8 normal_keycode)
-{
-    switch (normal_keycode)
-    {
-        case KEY_W: return KEY_Up;
-        case KEY_A: return KEY_Left;
-        case KEY_S: return KEY_Down;
-        case KEY_D: return KEY_Right;
-        case KEY_R: return KEY_PageUp;
-        case KEY_F: return KEY_PageDown;
-        case KEY_Q: return KEY_Home;
-        case KEY_E: return KEY_End;
-        case KEY_1: return KEY_F1;
-        case KEY_2: return KEY_F2;
-        case KEY_3: return KEY_F3;
-        case KEY_4: return KEY_F4;
-        case KEY_5: return KEY_F5;
-        case KEY_6: return KEY_F6;
-        case KEY_7: return KEY_F7;
-        case KEY_8: return KEY_F8;
-        case KEY_9: return KEY_F9;
-        case KEY_0: return KEY_F10;
-        case KEY_Minus: return KEY_F11;
-        case KEY_Equals: return KEY_F12;
-        
-        case KEY_LeftShift:
-        case KEY_RightShift:
-        case KEY_LeftAlt:
-        case KEY_RightAlt:
-        case KEY_LeftGUI:
-        case KEY_RightGUI:
-        case KEY_Menu:
-            return normal_keycode;
-    }
-    return 0;
-}
-        
-static void read_keypresses(void)
-{
-    static const uint8 keycodes[9][8] = {
-        { KEY_9, KEY_0,              KEY_LeftBracket,  KEY_Quote,     0,          KEY_P, KEY_Semicolon, KEY_Slash },
-        { KEY_8, KEY_Minus,          KEY_RightBracket, KEY_NonUSHash, 0,          KEY_O, KEY_L,         KEY_Period },
-        { KEY_7, KEY_Equals,         KEY_Insert,       KEY_Grave,     KEY_4,      KEY_I, KEY_K,         KEY_Comma },
-        { KEY_6, KEY_NonUSBackslash, KEY_Enter,        KEY_Magic,     KEY_5,      KEY_U, KEY_J,         KEY_M },
-        { 0,     0,                  0,                KEY_LeftAlt,   KEY_Escape, KEY_Q, KEY_A,         KEY_Z },
-        { KEY_G, KEY_H,              0,                KEY_Menu,      KEY_1,      KEY_W, KEY_S,         KEY_X },
-        { KEY_T, KEY_B,              0,                KEY_Space,     KEY_2,      KEY_E, KEY_D,         KEY_C },
-        { KEY_Y, KEY_N,              0,                KEY_LeftGUI,   KEY_3,      KEY_R, KEY_F,         KEY_V },
-        { 0,     KEY_Delete,         KEY_Enter,        KEY_RightAlt,  0,          0,     0,             0 }
-    };
-
-    static uint8 senses[16] = {};
-    uint8 probe = ProbeReg_Read();
-    uint8 sense = SenseReg_Read();
-    uint8 changed = senses[probe] ^ sense;
-
-    for (int y=0; y<8; y++)
-    {
-        if (changed & (1<<y))
-        {
-            uint8 keycode = keycodes[probe][y];
-            if (keycode)
-                post_keyevent(keycode, sense & (1<<y));
-        }
-    }
-
-    senses[probe] = sense;
-}
-
-static CY_ISR(ProbeInterrupt)
-{
-    read_modifiers();
-    read_keypresses();
-}
-
-int main(void)
-{
-    CyGlobalIntEnable;
-    LedReg_Write(1);
-    UART_Start();
-    ProbeCounter_Start();
-    ProbeInterrupt_StartEx(&ProbeInterrupt);
-    USBFS_Start(0, USBFS_DWR_VDDD_OPERATION);
-
-    UART_PutString("GO\r");
-    LedReg_Write(0);
-
-    for (;;)
-    {
-        if (!USBFS_GetConfiguration() || USBFS_IsConfigurationChanged())
-        {
-            UART_PutString("Waiting for USB configuration\r");
-            while (!USBFS_GetConfiguration())
-                ;
-            USBFS_EnableOutEP(2);
-            USBFS_LoadInEP(1, Keyboard_Data, 8);
-            UART_PutString("USB configuration done\r");
-        }
-
-        if ((readptr != writeptr) && USBFS_GetEPAckState(1))
-        {
-            char buffer[32];
-            struct queue_entry* entry = &queue[readptr];
-            //sprintf(buffer, "k=%d o=%d m=%02x\r", entry->keycode, entry->pressed, (uint8)~ModifierReg_Read());
-            UART_PutString(buffer);
-            LedReg_Write(0);
-            
-            static bool special_modifier = 0;
-            if (entry->keycode == KEY_Magic)
-                special_modifier = entry->pressed;
-            else
-            {
-                if (special_modifier)
-                    entry->keycode = alt_keycode(entry->keycode);
-                if (entry->keycode)
-                {
-                    if (entry->pressed)
-                    {
-                        switch (entry->keycode)
-                        {
-                            case KEY_LeftControl: modifiers |= MOD_LeftControl; break;
-                            case KEY_LeftShift:   modifiers |= MOD_LeftShift;   break;
-                            case KEY_LeftAlt:     modifiers |= MOD_LeftAlt;     break;
-                            case KEY_LeftGUI:     modifiers |= MOD_LeftGui;     break;
-                        }
-                        
-                        for (int i=2; i<8; i++)
-                            if (Keyboard_Data[i] == 0)
-                            {
-                                Keyboard_Data[i] = entry->keycode;
-                                break;
-                            }
-                    }
-                    else
-                    {
-                        switch (entry->keycode)
-                        {
-                            case KEY_LeftControl: modifiers &= ~MOD_LeftControl; break;
-                            case KEY_LeftShift:   modifiers &= ~MOD_LeftShift;   break;
-                            case KEY_LeftAlt:     modifiers &= ~MOD_LeftAlt;     break;
-                            case KEY_LeftGUI:     modifiers &= ~MOD_LeftGui;     break;
-                        }
-                        
-                        for (int i=2; i<8; i++)
-                            if (Keyboard_Data[i] == entry->keycode)
-                            {
-                                Keyboard_Data[i] = 0;
-                                break;
-                            }            
-                    }
-                    Keyboard_Data[0] = modifiers;
-                    USBFS_LoadInEP(1, Keyboard_Data, 8);
-                }
-            }
-           
-            readptr = (readptr+1) & (QUEUE_SIZE-1);
-        }
-    }
-}
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "project.h"
+#include "usbkeycodes.h"
+#include "report.h"
+#include "debounce.h"
+#include "frame.h"
+#include "keymap.h"
+#include "mapstore.h"
+#include "perf.h"
+#include "trace.h"
+#include "wheel.h"
+#include "combo.h"
+#include "eventlog.h"
+#include "selftest.h"
+
+#define QUEUE_SIZE 64
+
+/* Key events are queued as a 16-bit word: the top bit is set for a press,
+ * and the bottom byte is the key's position in the keymap (probe*8 +
+ * sense, with the modifier register appearing as an extra row), or, from
+ * KEYMAP_POSITIONS up, a combo. Keycodes are looked up when the event is
+ * consumed. */
+
+#define EVENT_PRESSED 0x8000
+#define EVENT_POSITION(e) ((e) & 0xff)
+#define NUM_POSITIONS (KEYMAP_POSITIONS + COMBO_MAX)
+#define MODIFIER_ROW 9
+#define MATRIX_ROWS MODIFIER_ROW
+#define NUM_ROWS KEYMAP_ROWS
+
+#if NUM_ROWS != FRAME_ROWS
+#error "the keymap and the frame don't agree on the number of rows"
+#endif
+
+/* The keymap, overlays, tap-hold keys and combos are generated from
+ * layout.txt and wiring.txt by tools/keymapc.py, which is run before every
+ * build. */
+
+#include "keymap_tables.h"
+
+/* Per-key debounce settings, laid out like the keymap. Every row, including
+ * the modifier register, is sampled once per frame. Presses are eager, so
+ * the debounce only ever delays releases. */
+
+#define DB (DEBOUNCE_EAGER | 2)
+
+static const uint8 debounce_config[NUM_ROWS][8] = {
+    { DB, DB, DB, DB, DB, DB, DB, DB },
+    { DB, DB, DB, DB, DB, DB, DB, DB },
+    { DB, DB, DB, DB, DB, DB, DB, DB },
+    { DB, DB, DB, DB, DB, DB, DB, DB },
+    { DB, DB, DB, DB, DB, DB, DB, DB },
+    { DB, DB, DB, DB, DB, DB, DB, DB },
+    { DB, DB, DB, DB, DB, DB, DB, DB },
+    { DB, DB, DB, DB, DB, DB, DB, DB },
+    { DB, DB, DB, DB, DB, DB, DB, DB },
+    /* Modifier register */
+    { DB, DB, DB, DB, DB, DB, DB, DB }
+};
+
+static struct debounce_row debounce[NUM_ROWS];
+
+/* This is a single-producer, single-consumer ring: writeptr is only written
+ * by ProbeInterrupt and readptr only by report_poll(). The barriers make
+ * sure an entry is complete before the index publishing it is seen, and that
+ * the consumer has finished with an entry before handing the slot back.
+ *
+ * For the latency statistics, the producer also records the cycle count of
+ * the scan which queued the oldest event not yet taken into a report; the
+ * consumer clears it once the queue is empty, so the next event starts a
+ * new measurement. */
+
+static uint16 queue[QUEUE_SIZE];
+static volatile uint8 readptr = 0;
+static volatile uint8 writeptr = 0;
+static uint32 unreported_cycles;
+static volatile bool unreported;
+static uint8 protocol;
+static volatile uint32 clock_ms;
+static volatile bool idle;
+static volatile bool usb_resumed;
+static volatile bool usb_ready;
+static volatile uint32 scan_cycles;
+static uint16 quiet_passes;
+
+static void post_keyevent(uint8 position, bool pressed)
+{
+    uint8 w = writeptr;
+    uint8 next = (w+1) & (QUEUE_SIZE-1);
+    uint8 r = readptr;
+    if (next != r)
+    {
+        queue[w] = position | (pressed ? EVENT_PRESSED : 0);
+        if (!unreported)
+        {
+            unreported_cycles = scan_cycles;
+            unreported = true;
+        }
+        __DMB();
+        writeptr = next;
+
+        uint8 used = (next - r) & (QUEUE_SIZE-1);
+        if (used > perf.queue_high_water)
+            perf.queue_high_water = used;
+    }
+    else
+    {
+        perf.events_dropped++;
+        LedReg_Write(true);
+    }
+}
+
+static bool peek_keyevent(uint16* event)
+{
+    uint8 r = readptr;
+    if (r == writeptr)
+        return false;
+    __DMB();
+    *event = queue[r];
+    return true;
+}
+
+static void pop_keyevent(void)
+{
+    __DMB();
+    readptr = (readptr+1) & (QUEUE_SIZE-1);
+}
+
+static uint8 used_keys(uint8 row)
+{
+    return keymap_used(row) | combo_used(row);
+}
+
+static void post_changes(uint8 row, uint8 sense, uint8 changed)
+{
+    for (int y=0; y<8; y++)
+    {
+        if (changed & (1<<y))
+        {
+            if (used_keys(row) & (1<<y))
+                combo_event(row*8 + y, sense & (1<<y));
+        }
+    }
+}
+
+/* Once nothing has been held down for IDLE_PASSES frames (about two
+ * seconds) ProbeInterrupt is switched off and SenseInterrupt, which fires
+ * on any edge on the sense lines, armed in its place; the main loop then
+ * sleeps between interrupts. The probe lines are driven by ProbeCounter in
+ * hardware, so that keeps running and a pressed key shows up on the sense
+ * lines within one probe cycle. The wake doesn't touch the debounce state,
+ * so the waking key is picked up as a normal press by the next scan. The
+ * modifier register isn't on the sense lines, so it is polled from SysTick
+ * instead.
+ *
+ * If the schematic has no SenseInterrupt, the sense lines are polled from
+ * SysTick too. ProbeCounter moves on a line a millisecond, as SysTick does,
+ * so successive ticks see successive lines and a key is noticed within a
+ * probe cycle; as with SenseInterrupt, any sense line going high wakes the
+ * scanner. */
+
+#define IDLE_PASSES 200
+
+#if defined(SenseInterrupt__INTC_NUMBER)
+
+static void enter_idle(void)
+{
+    idle = true;
+    ProbeInterrupt_Disable();
+    SenseInterrupt_ClearPending();
+    SenseInterrupt_Enable();
+}
+
+static void leave_idle(void)
+{
+    SenseInterrupt_Disable();
+    quiet_passes = 0;
+    idle = false;
+    ProbeInterrupt_Enable();
+}
+
+static CY_ISR(SenseInterrupt)
+{
+    leave_idle();
+}
+
+static void idle_start(void)
+{
+    SenseInterrupt_StartEx(&SenseInterrupt);
+    SenseInterrupt_Disable();
+}
+
+#else
+
+static void enter_idle(void)
+{
+    idle = true;
+    ProbeInterrupt_Disable();
+}
+
+static void leave_idle(void)
+{
+    quiet_passes = 0;
+    idle = false;
+    ProbeInterrupt_Enable();
+}
+
+static void idle_start(void)
+{
+}
+
+#endif
+
+static void check_idle(void)
+{
+    uint8 down = 0;
+    for (int i=0; i<NUM_ROWS; i++)
+        down |= debounce[i].state & used_keys(i);
+
+    if (down || (readptr != writeptr) || selftest_running())
+        quiet_passes = 0;
+    else if (++quiet_passes == IDLE_PASSES)
+        enter_idle();
+}
+
+/* The matrix is sampled a frame at a time: a byte of sense lines for each
+ * of the nine probe lines, plus the modifier register. Only rows which have
+ * changed since the previous frame, plus any rows whose debounce is still
+ * counting, need looking at. The whole frame is also checked for ghosting,
+ * which needs a consistent snapshot of the whole keyboard.
+ *
+ * If the schematic has a SenseDMA channel, DMA does the capturing into
+ * capture.rows[n] while probe line n is driven. Its request must fire once
+ * for each of the nine probe steps, and ProbeInterrupt must be moved onto
+ * its end-of-transfer output, so the CPU only takes one interrupt per frame
+ * and finds the changed rows by comparing frames a word at a time.
+ * Otherwise ProbeInterrupt reads each step itself, and processes each row
+ * as soon as it has been read, so a key in row 0 doesn't wait for the rest
+ * of the frame; the modifier register is read with the last row. */
+
+static union frame previous;
+static uint16 unsettled;
+
+static uint8 sample(uint8 y, uint8 sense)
+{
+    if (selftest_running())
+        sense ^= selftest_mask(y, scan_cycles);
+    return sense;
+}
+
+static void begin_frame(void)
+{
+    trace_pass();
+    perf.scan_passes++;
+}
+
+static void process_row(uint8 y, uint8 sense)
+{
+    uint16 bit = 1 << y;
+    if (sense != previous.rows[y])
+    {
+        previous.rows[y] = sense;
+        trace_record(y, sense);
+    }
+    else if (!(unsettled & bit))
+        return;
+
+    struct debounce_row* row = &debounce[y];
+    post_changes(y, row->state, debounce_update(row, sense));
+    if (row->state != sense)
+        unsettled |= bit;
+    else
+        unsettled &= ~bit;
+}
+
+static void end_frame(void)
+{
+    if (frame_ghosted(&previous, MATRIX_ROWS))
+        perf.ghosted_frames++;
+    check_idle();
+}
+
+#if defined(SenseDMA__DRQ_NUMBER)
+
+static union frame capture;
+
+static void capture_start(void)
+{
+    uint8 channel = SenseDMA_DmaInitialize(1, 1, HI16(CYDEV_PERIPH_BASE), HI16(CYDEV_SRAM_BASE));
+    uint8 td = CyDmaTdAllocate();
+    CyDmaTdSetConfiguration(td, MATRIX_ROWS, td, SenseDMA__TD_TERMOUT_EN | TD_INC_DST_ADR);
+    CyDmaTdSetAddress(td, LO16((uint32) SenseReg_Status_PTR), LO16((uint32) capture.rows));
+    CyDmaChSetInitialTd(channel, td);
+
+    /* Start on a frame boundary, so that capture.rows[n] is probe line n. */
+
+    while (ProbeReg_Read() != (MATRIX_ROWS-1))
+        ;
+    CyDmaChEnable(channel, 1);
+}
+
+static void process_frame(void)
+{
+    union frame f = capture;
+    f.rows[MODIFIER_ROW] = ~ModifierReg_Read(); /* active high */
+    for (int y=0; y<NUM_ROWS; y++)
+        f.rows[y] = sample(y, f.rows[y]);
+
+    uint16 rows = frame_diff(&f, &previous) | unsettled;
+    begin_frame();
+    while (rows)
+    {
+        uint8 y = __builtin_ctz(rows);
+        rows &= rows - 1;
+        process_row(y, f.rows[y]);
+    }
+    end_frame();
+}
+
+static CY_ISR(ProbeInterrupt)
+{
+    uint32 start = perf_cycles();
+    scan_cycles = start;
+    combo_poll();
+    process_frame();
+    perf_isr(start);
+}
+
+#else
+
+static void capture_start(void)
+{
+}
+
+static CY_ISR(ProbeInterrupt)
+{
+    uint32 start = perf_cycles();
+    scan_cycles = start;
+    combo_poll();
+    uint8 probe = ProbeReg_Read();
+    if (probe < MATRIX_ROWS)
+    {
+        if (probe == 0)
+            begin_frame();
+        process_row(probe, sample(probe, SenseReg_Read()));
+        if (probe == (MATRIX_ROWS-1))
+        {
+            process_row(MODIFIER_ROW, sample(MODIFIER_ROW, ~ModifierReg_Read())); /* active high */
+            end_frame();
+        }
+    }
+    perf_isr(start);
+}
+
+#endif
+
+static void clock_tick(void)
+{
+    clock_ms++;
+    wheel_tick();
+    eventlog_tick();
+    if (idle && ((uint8)~ModifierReg_Read() & used_keys(MODIFIER_ROW)))
+        leave_idle();
+#if !defined(SenseInterrupt__INTC_NUMBER)
+    if (idle && SenseReg_Read())
+        leave_idle();
+#endif
+}
+
+/* Called by the USBFS component when the D+ line interrupt fires, which it
+ * arms on suspend to catch the host resuming the bus. */
+
+void USBFS_DP_ISR_EntryCallback(void)
+{
+    usb_resumed = true;
+}
+
+/* Everything else written to the UART goes through these, which first
+ * finish off any event log record that's partly gone out. */
+
+static void print(const char* s)
+{
+    eventlog_finish();
+    UART_PutString(s);
+}
+
+static void print_char(char c)
+{
+    eventlog_finish();
+    UART_PutChar(c);
+}
+
+static void write_array(const uint8* data, uint8 length)
+{
+    eventlog_finish();
+    UART_PutArray(data, length);
+}
+
+/* The bus has gone quiet, so the host has suspended us. The USB block is put
+ * to sleep and the scanner idled, and the CPU sleeps until either the host
+ * resumes the bus or, if the host has allowed it, a key event is queued, in
+ * which case we signal remote wakeup. Keys pressed while remote wakeup is
+ * disabled are still queued, and get reported once the host comes back. */
+
+#define USB_ACTIVITY_MS 10
+#define USB_RESUME_MS 10
+
+static void usb_suspend(void)
+{
+    bool remote_wakeup = false;
+
+    print("USB suspended\r");
+    usb_resumed = false;
+    USBFS_Suspend();
+
+    uint8 state = CyEnterCriticalSection();
+    if (!idle)
+        enter_idle();
+    CyExitCriticalSection(state);
+
+    while (!usb_resumed)
+    {
+        if ((readptr != writeptr) && USBFS_RWUEnabled())
+        {
+            remote_wakeup = true;
+            break;
+        }
+        __WFI();
+    }
+
+    USBFS_Resume();
+    if (remote_wakeup)
+    {
+        /* Drive resume signalling (the K state) for 1 to 15ms. */
+        USBFS_Force(USBFS_FORCE_K);
+        CyDelay(USB_RESUME_MS);
+        USBFS_Force(USBFS_FORCE_NONE);
+    }
+    print("USB resumed\r");
+}
+
+static bool nkro_active(void)
+{
+#if REPORT_NKRO
+    return protocol == USBFS_PROTOCOL_REPORT;
+#else
+    return false;
+#endif
+}
+
+/* Reports are staged: queued events are folded into the next report as
+ * they arrive, so that it is ready to be loaded the moment the endpoint is
+ * free and a burst of events costs one USB frame rather than one per
+ * event. The only reason to hold events back for a later report is if a
+ * key changes twice before the host has seen the first change, which would
+ * otherwise lose a tap altogether.
+ *
+ * Normally all of this runs from the USB start-of-frame interrupt, once per
+ * millisecond, so the report is loaded at a fixed point just before the
+ * host's poll rather than whenever the main loop gets round to it.
+ * ProbeInterrupt also runs once a millisecond, from a clock locked to the
+ * same USB timebase, so its phase relative to the SOF is fixed; the perf
+ * counters record it. If the USBFS component has been configured without
+ * its SOF interrupt, the main loop does it instead, after every interrupt
+ * that wakes it (at least SysTick, once a millisecond). Either way a report
+ * can go no more often than the endpoint's bInterval lets the host poll. */
+
+static uint8 staged[sizeof(struct nkro_report)];
+static uint8 staged_length;
+static bool staged_dirty;
+static bool staged_stamped;
+static uint32 staged_cycles;
+static uint8 touched[NUM_POSITIONS / 8];
+
+static void stage_report(void)
+{
+    if (!staged_dirty && !USBFS_GetEPAckState(1))
+        perf.ep_stalls++;
+    staged_length = report_build(staged, nkro_active());
+    staged_dirty = true;
+    eventlog_put(EVENTLOG_REPORT, staged[0], staged_length);
+}
+
+static void send_staged_report(void)
+{
+    USBFS_LoadInEP(1, staged, staged_length);
+    perf.reports_sent++;
+    if (staged_stamped)
+    {
+        perf_latency(perf_cycles() - staged_cycles);
+        selftest_loaded(staged_cycles);
+    }
+    staged_dirty = false;
+    staged_stamped = false;
+    memset(touched, 0, sizeof(touched));
+}
+
+static bool apply_output(const uint16* output, uint8 count)
+{
+    bool changed = false;
+    for (int i=0; i<count; i++)
+    {
+        uint8 keycode = output[i];
+        eventlog_put(EVENTLOG_OUTPUT, 0, output[i]);
+        if (output[i] & KEYMAP_RELEASE)
+            changed |= report_release(REPORT_KEYBOARD, keycode);
+        else
+            changed |= report_press(REPORT_KEYBOARD, keycode);
+    }
+    return changed;
+}
+
+static void drain_keyevents(void)
+{
+    bool changed = false;
+    uint16 output[KEYMAP_MAX_OUTPUT];
+    uint16 event;
+
+    /* Output the keymap makes by itself (the end of a tap, or a hold whose
+     * time is up) waits for the report before it to go, and queued events
+     * wait behind it. */
+
+    if (keymap_pending())
+    {
+        if (staged_dirty)
+            return;
+        changed = apply_output(output, keymap_poll(output));
+    }
+
+    while (!keymap_pending() && peek_keyevent(&event))
+    {
+        uint8 position = EVENT_POSITION(event);
+        uint8 row = position >> 3;
+        uint8 bit = 1 << (position & 7);
+        if (touched[row] & bit)
+            break;
+
+        bool pressed = event & EVENT_PRESSED;
+        uint8 count;
+        if (position >= KEYMAP_POSITIONS)
+            count = keymap_action_event(combo_action(position - KEYMAP_POSITIONS), pressed, output);
+        else
+            count = keymap_event(position, pressed, output);
+
+        eventlog_put(EVENTLOG_EVENT, position, pressed);
+        LedReg_Write(0);
+
+        if (apply_output(output, count))
+        {
+            touched[row] |= bit;
+            changed = true;
+            if (!staged_stamped)
+            {
+                staged_cycles = unreported_cycles;
+                staged_stamped = true;
+            }
+        }
+
+        pop_keyevent();
+    }
+
+    if (unreported)
+    {
+        uint8 state = CyEnterCriticalSection();
+        if (readptr == writeptr)
+            unreported = false;
+        CyExitCriticalSection(state);
+    }
+
+    if (changed)
+        stage_report();
+}
+
+static void report_poll(void)
+{
+    if (!usb_ready)
+        return;
+
+    /* The host may switch between the boot and report protocols at any
+     * time (SET_PROTOCOL); resend the current state in the new format. */
+
+    if (USBFS_GetProtocol(0) != protocol)
+    {
+        protocol = USBFS_GetProtocol(0);
+        stage_report();
+    }
+
+    drain_keyevents();
+    if (staged_dirty && USBFS_GetEPAckState(1))
+        send_staged_report();
+}
+
+#if !USBFS_SOF_ISR_REMOVE
+
+/* Called by the USBFS component on every start-of-frame. */
+
+void USBFS_SOF_ISR_EntryCallback(void)
+{
+    perf_sof_offset(perf_cycles() - scan_cycles);
+    report_poll();
+}
+
+#endif
+
+/* Called by the USBFS component when the host has taken a report. */
+
+void USBFS_EP_1_ISR_EntryCallback(void)
+{
+    selftest_acked();
+}
+
+/* Brings the USB side up, or back up after the host reconfigures us,
+ * without blocking: the scanner keeps running meanwhile, and keys pressed
+ * before it's done stay queued until they can be sent. */
+
+static uint32 usb_activity_ms;
+
+static void usb_poll(void)
+{
+    static bool waiting = false;
+
+    bool changed = USBFS_IsConfigurationChanged();
+    if (!USBFS_GetConfiguration())
+    {
+        usb_ready = false;
+        if (!waiting)
+        {
+            print("Waiting for USB configuration\r");
+            waiting = true;
+        }
+        return;
+    }
+    if (usb_ready && !changed)
+        return;
+
+    usb_ready = false;
+    USBFS_EnableOutEP(2);
+    protocol = USBFS_GetProtocol(0);
+    stage_report();
+    send_staged_report();
+    usb_ready = true;
+    waiting = false;
+    usb_activity_ms = clock_ms;
+    if (!perf.first_report_ms)
+        perf.first_report_ms = clock_ms;
+    print("USB configuration done\r");
+}
+
+/* A keymap upload (l on the serial port, followed by the image; see
+ * mapstore.h) takes over the serial port until the whole image has
+ * arrived, or nothing has for LOAD_TIMEOUT_MS. The serial port has very
+ * little buffering and writing flash stalls the CPU, so the sender must
+ * wait for a '.' after each row's worth of bytes; the main loop doesn't
+ * sleep while an upload is going on. */
+
+#define LOAD_TIMEOUT_MS 1000
+
+static bool loading;
+static uint32 load_ms;
+
+static void load_start(void)
+{
+    loading = mapstore_begin();
+    load_ms = clock_ms;
+    if (!loading)
+        print("Keymap busy\r");
+}
+
+static void load_poll(void)
+{
+    while (UART_GetRxBufferSize())
+    {
+        load_ms = clock_ms;
+        switch (mapstore_put(UART_ReadRxData()))
+        {
+            case MAPSTORE_MORE:
+                continue;
+
+            case MAPSTORE_ROW:
+                print_char('.');
+                continue;
+
+            case MAPSTORE_DONE:
+                print("Keymap loaded\r");
+                break;
+
+            default:
+                print("Keymap load failed\r");
+                break;
+        }
+        loading = false;
+        return;
+    }
+
+    if ((clock_ms - load_ms) >= LOAD_TIMEOUT_MS)
+    {
+        print("Keymap load timed out\r");
+        loading = false;
+    }
+}
+
+/* The self-test presses left shift, which is harmless. */
+
+#define SELFTEST_POSITION (MODIFIER_ROW*8 + 0)
+
+static void selftest_begin(void)
+{
+    if (!usb_ready || !selftest_start(SELFTEST_POSITION, SELFTEST_ITERATIONS))
+    {
+        print("Self-test can't start\r");
+        return;
+    }
+
+    uint8 state = CyEnterCriticalSection();
+    if (idle)
+        leave_idle();
+    CyExitCriticalSection(state);
+    print("Self-test running\r");
+}
+
+int main(void)
+{
+    CyGlobalIntEnable;
+    LedReg_Write(1);
+    UART_Start();
+    perf_init();
+    CySysTickStart();
+    CySysTickSetCallback(0, clock_tick);
+
+    /* Start enumerating first; it happens in the background. */
+
+    USBFS_Start(0, USBFS_DWR_VDDD_OPERATION);
+    combo_init(combos, NUM_COMBOS, post_keyevent);
+    if (!mapstore_init())
+        keymap_init(&base_layer, overlays, NUM_OVERLAYS, tapholds, NUM_TAPHOLDS);
+    for (int i=0; i<NUM_ROWS; i++)
+        debounce_init(&debounce[i], debounce_config[i]);
+    ProbeCounter_Start();
+    capture_start();
+    ProbeInterrupt_StartEx(&ProbeInterrupt);
+    idle_start();
+
+    print("GO\r");
+    LedReg_Write(0);
+
+    for (;;)
+    {
+        usb_poll();
+
+        /* An active bus sees a SOF every millisecond. */
+
+        if (usb_ready && ((clock_ms - usb_activity_ms) >= USB_ACTIVITY_MS))
+        {
+            usb_activity_ms = clock_ms;
+            if (!USBFS_CheckActivity())
+                usb_suspend();
+        }
+
+#if USBFS_SOF_ISR_REMOVE
+        report_poll();
+#endif
+
+        if (loading)
+        {
+            load_poll();
+            continue;
+        }
+
+        eventlog_drain();
+        selftest_poll(print);
+
+        /* Commands from the serial port: c dumps the performance counters,
+         * d dumps the scan trace (in binary; see trace.h), g turns the event
+         * log (see eventlog.h) on and off, l uploads a keymap, and s runs the
+         * latency self-test (see selftest.h). */
+
+        switch (UART_GetChar())
+        {
+            case 'c':
+                perf_dump(print, clock_ms);
+                break;
+
+            case 'd':
+                trace_dump(write_array, NUM_ROWS);
+                break;
+
+            case 'g':
+                eventlog_enable(!eventlog_enabled());
+                print(eventlog_enabled() ? "Event log on\r" : "Event log off\r");
+                break;
+
+            case 'l':
+                load_start();
+                break;
+
+            case 's':
+                selftest_begin();
+                break;
+        }
+
+        /* Reports are sent from the SOF interrupt, or at the top of the
+         * loop, so there's nothing to do until the next interrupt. */
+
+        __WFI();
+    }
+}
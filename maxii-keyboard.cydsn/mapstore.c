@@ -0,0 +1,224 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "project.h"
+#include "keymap.h"
+#include "mapstore.h"
+
+#define ROW_SIZE CYDEV_FLS_ROW_SIZE
+#define NO_BANK 0xff
+#define PAD4(n) (((n) + 3) & ~3)
+
+#if (MAPSTORE_BANK_SIZE % ROW_SIZE) != 0
+#error "keymap banks must be a whole number of flash rows"
+#endif
+
+/* As far as the compiler knows, the banks are constant and all zero, so
+ * they are only ever read through bank_data, which it can't see through;
+ * otherwise it would be entitled to fold the reads away. */
+
+static const uint8 CY_ALIGN(ROW_SIZE) banks[2][MAPSTORE_BANK_SIZE] = {{0}};
+static const uint8* const volatile bank_data[2] = { banks[0], banks[1] };
+
+/* What has been found in each bank. The overlay descriptors have to be in
+ * RAM, as they hold pointers, but everything they point at is in flash. */
+
+struct bank_map
+{
+    uint16 sequence;
+    const keymap_layer_t* base;
+    struct keymap_overlay overlays[KEYMAP_MAX_LAYERS-1];
+    uint8 overlay_count;
+    const struct keymap_taphold* tapholds;
+    uint8 taphold_count;
+};
+
+static struct bank_map maps[2];
+static uint8 live = NO_BANK;
+
+static uint8 row_buffer[ROW_SIZE];
+static uint8 spc_buffer[ROW_SIZE + CYDEV_ECC_ROW_SIZE];
+static uint8 target = NO_BANK;
+static uint16 received;
+static uint16 expected;
+static bool skipping;
+
+static uint32 crc32(uint32 crc, const uint8* data, uint16 length)
+{
+    crc = ~crc;
+    while (length--)
+    {
+        crc ^= *data++;
+        for (int i=0; i<8; i++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static bool parse(uint8 bank)
+{
+    const uint8* image = bank_data[bank];
+    const struct mapstore_header* h = (const struct mapstore_header*) image;
+    struct bank_map* map = &maps[bank];
+
+    if (memcmp(h->magic, "KMAP", 4)
+            || (h->version != MAPSTORE_VERSION)
+            || (h->rows != KEYMAP_ROWS)
+            || (h->length < sizeof(*h))
+            || (h->length > MAPSTORE_BANK_SIZE)
+            || (h->overlays > (KEYMAP_MAX_LAYERS-1))
+            || (h->tapholds > KEYMAP_MAX_TAPHOLDS))
+        return false;
+
+    uint16 covered = offsetof(struct mapstore_header, crc) + sizeof(h->crc);
+    if (crc32(0, image + covered, h->length - covered) != h->crc)
+        return false;
+
+    uint16 offset = sizeof(*h);
+    map->base = (const keymap_layer_t*) (image + offset);
+    offset += PAD4(KEYMAP_POSITIONS);
+
+    for (int i=0; i<h->overlays; i++)
+    {
+        if ((offset + sizeof(struct mapstore_overlay)) > h->length)
+            return false;
+        const struct mapstore_overlay* o = (const struct mapstore_overlay*) (image + offset);
+        offset += sizeof(*o);
+
+        struct keymap_overlay* d = &map->overlays[i];
+        d->present = &o->present;
+        d->actions = image + offset;
+        d->count = o->count;
+        d->transparent = o->transparent;
+        offset += PAD4(o->count);
+    }
+
+    map->tapholds = (const struct keymap_taphold*) (image + offset);
+    offset += h->tapholds * sizeof(struct keymap_taphold);
+    if (offset > h->length)
+        return false;
+
+    map->sequence = h->sequence;
+    map->overlay_count = h->overlays;
+    map->taphold_count = h->tapholds;
+    return true;
+}
+
+bool mapstore_init(void)
+{
+    bool valid0 = parse(0);
+    bool valid1 = parse(1);
+    if (valid0 && valid1)
+        live = ((int16) (maps[1].sequence - maps[0].sequence) > 0) ? 1 : 0;
+    else if (valid0 || valid1)
+        live = valid1 ? 1 : 0;
+    else
+        return false;
+
+    struct bank_map* map = &maps[live];
+    keymap_init(map->base, map->overlays, map->overlay_count,
+        map->tapholds, map->taphold_count);
+    return true;
+}
+
+bool mapstore_begin(void)
+{
+    if (keymap_replacing())
+        return false;
+    if ((CySetTemp() != CYRET_SUCCESS) || (CySetFlashEEBuffer(spc_buffer) != CYRET_SUCCESS))
+        return false;
+
+    target = (live == 0) ? 1 : 0;
+    received = 0;
+    expected = sizeof(struct mapstore_header);
+    skipping = false;
+    return true;
+}
+
+static bool write_row(uint8 row)
+{
+    uint32 address = (uint32) &bank_data[target][row * ROW_SIZE] - CYDEV_FLASH_BASE;
+    cystatus status = CyWriteRowData(address / CYDEV_FLS_SECTOR_SIZE,
+        (address % CYDEV_FLS_SECTOR_SIZE) / ROW_SIZE, row_buffer);
+    CyFlushCache();
+    return status == CYRET_SUCCESS;
+}
+
+static uint8 progress(void)
+{
+    return (received % ROW_SIZE) ? MAPSTORE_MORE : MAPSTORE_ROW;
+}
+
+/* Once an upload has gone wrong the rest of the image is still read, and
+ * thrown away, so that it isn't taken for commands; the failure is only
+ * reported when the header says the image ends. expected is 0 if the header
+ * itself was bad, in which case everything is thrown away until the caller
+ * gives up. */
+
+static uint8 fail(void)
+{
+    target = NO_BANK;
+    skipping = (received != expected);
+    return skipping ? progress() : MAPSTORE_FAILED;
+}
+
+uint8 mapstore_put(uint8 byte)
+{
+    if (skipping)
+    {
+        if (!expected)
+            return MAPSTORE_MORE;
+        received++;
+        return fail();
+    }
+    if (target == NO_BANK)
+        return MAPSTORE_FAILED;
+
+    row_buffer[received % ROW_SIZE] = byte;
+    received++;
+
+    if (received == sizeof(struct mapstore_header))
+    {
+        struct mapstore_header* h = (struct mapstore_header*) row_buffer;
+        if (memcmp(h->magic, "KMAP", 4))
+        {
+            expected = 0;
+            return fail();
+        }
+
+        expected = (h->length < received) ? received : h->length;
+        if ((h->length < sizeof(*h)) || (h->length > MAPSTORE_BANK_SIZE))
+            return fail();
+
+        h->sequence = (live == NO_BANK) ? 1 : (maps[live].sequence + 1);
+    }
+
+    bool end = (received == expected);
+    if (end)
+        memset(row_buffer + (received % ROW_SIZE), 0, (ROW_SIZE - (received % ROW_SIZE)) % ROW_SIZE);
+    if (end || !(received % ROW_SIZE))
+    {
+        if (!write_row((received - 1) / ROW_SIZE))
+            return fail();
+    }
+    if (!end)
+        return progress();
+
+    /* The image is only trusted once it's been read back out of flash. */
+
+    uint8 bank = target;
+    target = NO_BANK;
+    if (!parse(bank))
+        return MAPSTORE_FAILED;
+
+    live = bank;
+    struct bank_map* map = &maps[live];
+    keymap_replace(map->base, map->overlays, map->overlay_count,
+        map->tapholds, map->taphold_count);
+    return MAPSTORE_DONE;
+}
@@ -0,0 +1,126 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "project.h"
+#include "perf.h"
+
+struct perf_counters perf;
+
+void perf_init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    memset(&perf, 0, sizeof(perf));
+    perf.isr_cycles_min = UINT32_MAX;
+    perf.latency_cycles_min = UINT32_MAX;
+    perf.sof_offset_cycles_min = UINT32_MAX;
+}
+
+void perf_isr(uint32 start_cycles)
+{
+    uint32 cycles = perf_cycles() - start_cycles;
+    perf.isr_count++;
+    perf.isr_cycles_total += cycles;
+    if (cycles < perf.isr_cycles_min)
+        perf.isr_cycles_min = cycles;
+    if (cycles > perf.isr_cycles_max)
+        perf.isr_cycles_max = cycles;
+}
+
+void perf_latency(uint32 cycles)
+{
+    perf.latency_count++;
+    perf.latency_cycles_total += cycles;
+    if (cycles < perf.latency_cycles_min)
+        perf.latency_cycles_min = cycles;
+    if (cycles > perf.latency_cycles_max)
+        perf.latency_cycles_max = cycles;
+}
+
+void perf_sof_offset(uint32 cycles)
+{
+    if (cycles < perf.sof_offset_cycles_min)
+        perf.sof_offset_cycles_min = cycles;
+    if (cycles > perf.sof_offset_cycles_max)
+        perf.sof_offset_cycles_max = cycles;
+}
+
+static unsigned long us(uint64 cycles)
+{
+    return (unsigned long) (cycles / (BCLK__BUS_CLK__HZ / 1000000));
+}
+
+void perf_dump(void (*print)(const char* s), uint32 now_ms)
+{
+    static uint32 last_ms;
+    static uint32 last_passes;
+    struct perf_counters p;
+    char buffer[80];
+
+    uint8 state = CyEnterCriticalSection();
+    p = perf;
+    perf.isr_count = 0;
+    perf.isr_cycles_total = 0;
+    perf.isr_cycles_min = UINT32_MAX;
+    perf.isr_cycles_max = 0;
+    perf.latency_count = 0;
+    perf.latency_cycles_total = 0;
+    perf.latency_cycles_min = UINT32_MAX;
+    perf.latency_cycles_max = 0;
+    perf.sof_offset_cycles_min = UINT32_MAX;
+    perf.sof_offset_cycles_max = 0;
+    CyExitCriticalSection(state);
+
+    uint32 elapsed = now_ms - last_ms;
+    uint32 passes = p.scan_passes - last_passes;
+    last_ms = now_ms;
+    last_passes = p.scan_passes;
+
+    if (p.isr_count)
+        snprintf(buffer, sizeof(buffer), "isr: n=%lu min=%lu avg=%lu max=%lu cycles\r\n",
+            (unsigned long) p.isr_count, (unsigned long) p.isr_cycles_min,
+            (unsigned long) (p.isr_cycles_total / p.isr_count), (unsigned long) p.isr_cycles_max);
+    else
+        snprintf(buffer, sizeof(buffer), "isr: n=0\r\n");
+    print(buffer);
+
+    snprintf(buffer, sizeof(buffer), "scan: %lu passes/s ghosted=%lu\r\n",
+        elapsed ? (unsigned long) (((uint64) passes * 1000) / elapsed) : 0UL,
+        (unsigned long) p.ghosted_frames);
+    print(buffer);
+
+    snprintf(buffer, sizeof(buffer), "queue: high=%lu dropped=%lu\r\n",
+        (unsigned long) p.queue_high_water, (unsigned long) p.events_dropped);
+    print(buffer);
+
+    snprintf(buffer, sizeof(buffer), "usb: reports=%lu stalls=%lu\r\n",
+        (unsigned long) p.reports_sent, (unsigned long) p.ep_stalls);
+    print(buffer);
+
+    if (p.latency_count)
+        snprintf(buffer, sizeof(buffer), "latency: n=%lu min=%luus avg=%luus max=%luus jitter=%luus\r\n",
+            (unsigned long) p.latency_count, us(p.latency_cycles_min),
+            us(p.latency_cycles_total / p.latency_count), us(p.latency_cycles_max),
+            us(p.latency_cycles_max - p.latency_cycles_min));
+    else
+        snprintf(buffer, sizeof(buffer), "latency: n=0\r\n");
+    print(buffer);
+
+    snprintf(buffer, sizeof(buffer), "startup: first report at %lums\r\n",
+        (unsigned long) p.first_report_ms);
+    print(buffer);
+
+    if (p.sof_offset_cycles_max)
+    {
+        snprintf(buffer, sizeof(buffer), "sof: scan leads by %lu-%luus\r\n",
+            us(p.sof_offset_cycles_min), us(p.sof_offset_cycles_max));
+        print(buffer);
+    }
+}
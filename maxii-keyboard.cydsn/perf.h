@@ -0,0 +1,59 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+/* Performance counters. Each field has exactly one writer: the isr_*,
+ * queue_*, events_dropped, scan_passes and ghosted_frames fields are only
+ * written from ProbeInterrupt; reports_sent, ep_stalls and the latency_*
+ * fields by whatever sends reports, which is the USB SOF interrupt if the
+ * USBFS component has one and the main loop if not (see report_poll() in
+ * main.c); the sof_* fields only from the SOF interrupt; and the rest only
+ * from the main loop, so nobody needs to lock to update them. The ISR timings are in CPU
+ * cycles, measured with the DWT cycle counter. Latency is measured from
+ * the scan which saw a key to the report carrying it being loaded, and
+ * sof_offset is how long before each SOF the scanner last ran. The timings
+ * cover the period since the last dump. first_report_ms is the time from
+ * reset to the first report after USB configuration. */
+
+struct perf_counters
+{
+    uint32 isr_count;
+    uint32 isr_cycles_min;
+    uint32 isr_cycles_max;
+    uint64 isr_cycles_total;
+    uint32 queue_high_water;
+    uint32 events_dropped;
+    uint32 scan_passes;
+    uint32 ghosted_frames;
+    uint32 reports_sent;
+    uint32 ep_stalls;
+    uint32 latency_count;
+    uint32 latency_cycles_min;
+    uint32 latency_cycles_max;
+    uint64 latency_cycles_total;
+    uint32 sof_offset_cycles_min;
+    uint32 sof_offset_cycles_max;
+    uint32 first_report_ms;
+};
+
+extern struct perf_counters perf;
+
+static inline uint32 perf_cycles(void)
+{
+    return DWT->CYCCNT;
+}
+
+extern void perf_init(void);
+extern void perf_isr(uint32 start_cycles);
+extern void perf_latency(uint32 cycles);
+extern void perf_sof_offset(uint32 cycles);
+
+/* Takes a consistent snapshot of the counters and writes it out a line at
+ * a time through print. now_ms is used to work out the scan rate. */
+
+extern void perf_dump(void (*print)(const char* s), uint32 now_ms);
+
+#endif
@@ -0,0 +1,199 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "project.h"
+#include "usbkeycodes.h"
+#include "report.h"
+
+/* The key state is held as one bit per usage, for the NKRO report, and as
+ * the boot report's six slots, which are kept up to date as keys go up and
+ * down. slot_of[] says which slot (plus one) each usage is in, so neither a
+ * press nor a release has to search for it, and building a boot report is
+ * a copy. A key pressed while all six slots are full gets no slot; when a
+ * slot is freed, the bitmap is searched for such a key to fill it, but that
+ * only happens with more than six keys down. The modifier usages (0xe0 to
+ * 0xe7) map directly onto the bits of the modifier byte.
+ *
+ * That's the combined state of all the sources. Each source also has a
+ * bitmap of its own, modifiers included, which is only used to decide
+ * whether a press or release changes the combined state. */
+
+#define BOOT_SLOTS 6
+#define ALL_SLOTS_FREE ((1 << BOOT_SLOTS) - 1)
+
+static uint8 modifiers;
+static uint8 bitmap[REPORT_USAGES / 8];
+static uint8 pressed;
+static uint8 slots[BOOT_SLOTS];
+static uint8 slot_of[REPORT_USAGES];
+static uint8 free_slots = ALL_SLOTS_FREE;
+static uint8 source_modifiers[REPORT_SOURCES];
+static uint8 source_bitmap[REPORT_SOURCES][REPORT_USAGES / 8];
+
+static bool is_modifier(uint8 keycode)
+{
+    return (keycode >= KEY_LeftControl) && (keycode <= KEY_RightGUI);
+}
+
+static void take_slot(uint8 keycode)
+{
+    uint8 slot = __builtin_ctz(free_slots);
+    free_slots &= ~(1 << slot);
+    slots[slot] = keycode;
+    slot_of[keycode] = slot + 1;
+}
+
+/* Finds a pressed key without a slot. */
+
+static void refill_slot(void)
+{
+    for (unsigned i=0; i<sizeof(bitmap); i++)
+    {
+        uint8 b = bitmap[i];
+        while (b)
+        {
+            uint8 keycode = (i << 3) | __builtin_ctz(b);
+            if (!slot_of[keycode])
+            {
+                take_slot(keycode);
+                return;
+            }
+            b &= b - 1;
+        }
+    }
+}
+
+/* Returns true if any source other than this one holds the key. */
+
+static bool held_elsewhere(uint8 source, uint8 keycode)
+{
+    for (unsigned s=0; s<REPORT_SOURCES; s++)
+    {
+        if (s == source)
+            continue;
+        if (is_modifier(keycode))
+        {
+            if (source_modifiers[s] & (1 << (keycode - KEY_LeftControl)))
+                return true;
+        }
+        else if (source_bitmap[s][keycode >> 3] & (1 << (keycode & 7)))
+            return true;
+    }
+    return false;
+}
+
+bool report_press(uint8 source, uint8 keycode)
+{
+    if (is_modifier(keycode))
+    {
+        uint8 bit = 1 << (keycode - KEY_LeftControl);
+        if (source_modifiers[source] & bit)
+            return false;
+        source_modifiers[source] |= bit;
+        if (modifiers & bit)
+            return false;
+        modifiers |= bit;
+        return true;
+    }
+
+    if (keycode >= REPORT_USAGES)
+        return false;
+
+    uint8* p = &source_bitmap[source][keycode >> 3];
+    uint8 bit = 1 << (keycode & 7);
+    if (*p & bit)
+        return false;
+    *p |= bit;
+
+    p = &bitmap[keycode >> 3];
+    if (*p & bit)
+        return false;
+    *p |= bit;
+    pressed++;
+    if (free_slots)
+        take_slot(keycode);
+    return true;
+}
+
+bool report_release(uint8 source, uint8 keycode)
+{
+    if (is_modifier(keycode))
+    {
+        uint8 bit = 1 << (keycode - KEY_LeftControl);
+        if (!(source_modifiers[source] & bit))
+            return false;
+        source_modifiers[source] &= ~bit;
+        if (held_elsewhere(source, keycode))
+            return false;
+        modifiers &= ~bit;
+        return true;
+    }
+
+    if (keycode >= REPORT_USAGES)
+        return false;
+
+    uint8* p = &source_bitmap[source][keycode >> 3];
+    uint8 bit = 1 << (keycode & 7);
+    if (!(*p & bit))
+        return false;
+    *p &= ~bit;
+    if (held_elsewhere(source, keycode))
+        return false;
+
+    bitmap[keycode >> 3] &= ~bit;
+    pressed--;
+
+    uint8 slot = slot_of[keycode];
+    if (slot)
+    {
+        slot--;
+        slot_of[keycode] = 0;
+        slots[slot] = 0;
+        free_slots |= 1 << slot;
+        if (pressed >= BOOT_SLOTS)
+            refill_slot();
+    }
+    return true;
+}
+
+bool report_down(uint8 keycode)
+{
+    if (is_modifier(keycode))
+        return modifiers & (1 << (keycode - KEY_LeftControl));
+    if (keycode >= REPORT_USAGES)
+        return false;
+    return bitmap[keycode >> 3] & (1 << (keycode & 7));
+}
+
+uint8 report_count(void)
+{
+    return pressed;
+}
+
+uint8 report_build(uint8* buffer, bool nkro)
+{
+    if (nkro)
+    {
+        struct nkro_report* report = (struct nkro_report*) buffer;
+        report->modifiers = modifiers;
+        memcpy(report->bitmap, bitmap, sizeof(bitmap));
+        return sizeof(struct nkro_report);
+    }
+
+    struct boot_report* report = (struct boot_report*) buffer;
+    report->modifiers = modifiers;
+    report->reserved = 0;
+    if (pressed > BOOT_SLOTS)
+    {
+        /* Too many keys for the boot report; the HID spec says to report
+         * rollover in every slot and let the host keep its previous state. */
+        memset(report->keys, KEY_ErrorRollOver, sizeof(report->keys));
+    }
+    else
+        memcpy(report->keys, slots, sizeof(report->keys));
+    return sizeof(struct boot_report);
+}
@@ -0,0 +1,65 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef REPORT_H
+#define REPORT_H
+
+/* Set to 1 to send N-key-rollover reports when the host has selected the
+ * report protocol. This needs the HID report descriptor and the IN endpoint
+ * size in the USBFS component changing to match struct nkro_report; with it
+ * set to 0 only the 6KRO boot report is ever sent. */
+
+#ifndef REPORT_NKRO
+#define REPORT_NKRO 0
+#endif
+
+/* Usages 0..119, which covers everything up to KEY_Menu. */
+
+#define REPORT_USAGES 120
+
+struct boot_report
+{
+    uint8 modifiers;
+    uint8 reserved;
+    uint8 keys[6];
+};
+
+struct nkro_report
+{
+    uint8 modifiers;
+    uint8 bitmap[REPORT_USAGES / 8];
+};
+
+/* Keys are pressed on behalf of a source: the keyboard itself, or keystrokes
+ * typed for the host (typestar4's inject.c). Each source's keys are tracked
+ * separately, so that neither can release a key the other is holding; a key
+ * is down in the report while any source holds it. */
+
+enum
+{
+    REPORT_KEYBOARD,
+    REPORT_INJECTED,
+    REPORT_SOURCES
+};
+
+/* Both of these return true if the report actually changed. */
+
+extern bool report_press(uint8 source, uint8 keycode);
+extern bool report_release(uint8 source, uint8 keycode);
+
+/* Whether the key is down in the report, from any source. */
+
+extern bool report_down(uint8 keycode);
+
+/* Returns how many non-modifier keys are down. A boot report only has room
+ * for six. */
+
+extern uint8 report_count(void);
+
+/* Writes the current state into buffer (which must be big enough for either
+ * report) and returns the number of bytes used. */
+
+extern uint8 report_build(uint8* buffer, bool nkro);
+
+#endif
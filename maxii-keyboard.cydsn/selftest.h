@@ -0,0 +1,55 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef SELFTEST_H
+#define SELFTEST_H
+
+/* Latency self-test. A key is pressed and released in software, by XORing
+ * it into the sense lines at the point where they are read, and the time
+ * each press takes to reach the host is measured with the cycle counter:
+ * first to the report carrying it being loaded into the endpoint, and then
+ * to the host ACKing that report. Each edge waits for the previous one to
+ * be ACKed and then for SELFTEST_GAP_US, which is longer than any debounce,
+ * so the edges don't interfere. Only presses are timed; releases include
+ * the debounce by design. The key should be one whose press is harmless,
+ * such as a shift key. The result is a histogram of both latencies, in
+ * SELFTEST_BUCKET_US buckets, with the last bucket catching everything
+ * longer.
+ *
+ * The scanner, whatever sends reports, the endpoint interrupt and the main
+ * loop each only move the test on from states which are theirs, so nothing
+ * needs to lock apart from the main loop. */
+
+#define SELFTEST_ITERATIONS 1000
+#define SELFTEST_GAP_US 50000
+#define SELFTEST_TIMEOUT_US 100000
+#define SELFTEST_BUCKET_US 100
+#define SELFTEST_BUCKETS 40
+
+/* Starts a test, returning false if one is already running. */
+
+extern bool selftest_start(uint8 position, uint16 iterations);
+extern bool selftest_running(void);
+
+/* Called by the scanner for each row it reads, at the time of the scan
+ * which read it; returns a mask to XOR into the row's sense byte, with a
+ * set bit meaning pressed. */
+
+extern uint8 selftest_mask(uint8 row, uint32 scan_cycles);
+
+/* Called from report_poll() just after a report has been loaded into the
+ * endpoint, with the scan time of the earliest event it carries. */
+
+extern void selftest_loaded(uint32 event_cycles);
+
+/* Called from the endpoint interrupt when the host has ACKed a report. */
+
+extern void selftest_acked(void);
+
+/* Called from the main loop. Stops a test which has stalled, and writes
+ * out the results, a line at a time through print, when one finishes. */
+
+extern void selftest_poll(void (*print)(const char* s));
+
+#endif
@@ -0,0 +1,78 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "project.h"
+#include "trace.h"
+
+#define DUMP_CHUNK 64
+
+static struct trace_entry ring[TRACE_ENTRIES];
+static uint16 head;
+static uint16 count;
+static uint32 passes;
+static volatile bool paused;
+
+static void put(uint16 delta, uint8 row, uint8 sense)
+{
+    struct trace_entry* e = &ring[head];
+    e->delta = delta;
+    e->row = row;
+    e->sense = sense;
+    head = (head+1) % TRACE_ENTRIES;
+    if (count < TRACE_ENTRIES)
+        count++;
+}
+
+void trace_pass(void)
+{
+    passes++;
+}
+
+void trace_record(uint8 row, uint8 sense)
+{
+    if (paused)
+        return;
+
+    while (passes > UINT16_MAX)
+    {
+        put(UINT16_MAX, TRACE_ROW_TIME, 0);
+        passes -= UINT16_MAX;
+    }
+    put(passes, row, sense);
+    passes = 0;
+}
+
+void trace_dump(void (*write)(const uint8* data, uint8 length), uint8 rows)
+{
+    paused = true;
+
+    struct trace_header h;
+    memcpy(h.magic, "KTRC", 4);
+    h.version = TRACE_VERSION;
+    h.rows = rows;
+    h.count = count;
+    write((const uint8*) &h, sizeof(h));
+
+    /* Nothing else touches the ring while it's paused. */
+
+    uint16 i = (head + TRACE_ENTRIES - count) % TRACE_ENTRIES;
+    uint16 left = count;
+    while (left)
+    {
+        uint16 n = TRACE_ENTRIES - i;
+        if (n > left)
+            n = left;
+        if (n > (DUMP_CHUNK / sizeof(struct trace_entry)))
+            n = DUMP_CHUNK / sizeof(struct trace_entry);
+
+        write((const uint8*) &ring[i], n * sizeof(struct trace_entry));
+        i = (i + n) % TRACE_ENTRIES;
+        left -= n;
+    }
+
+    paused = false;
+}
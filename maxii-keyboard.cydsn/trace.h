@@ -0,0 +1,49 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/* A flight recorder for the raw matrix: every change in a row's raw sense
+ * byte, before debouncing, goes into a ring in RAM which keeps the most
+ * recent TRACE_ENTRIES changes. Time is counted in scan passes rather than
+ * wall-clock time, so a trace can be fed back through the scanner pass by
+ * pass and give exactly the same result. Passes aren't counted while the
+ * scanner is idle, and changes aren't recorded while a dump is going on.
+ *
+ * The dump format, all little-endian, is a struct trace_header followed by
+ * count struct trace_entry records, oldest first. Each entry's delta is the
+ * number of passes since the previous entry. Gaps too long for delta are
+ * filled with TRACE_ROW_TIME entries, which carry time but no change. */
+
+#define TRACE_ENTRIES 512
+#define TRACE_VERSION 1
+#define TRACE_ROW_TIME 0xff
+
+struct trace_header
+{
+    char magic[4];              /* "KTRC" */
+    uint8 version;
+    uint8 rows;
+    uint16 count;
+};
+
+struct trace_entry
+{
+    uint16 delta;
+    uint8 row;
+    uint8 sense;
+};
+
+/* Both of these are only called from the scanner. */
+
+extern void trace_pass(void);
+extern void trace_record(uint8 row, uint8 sense);
+
+/* Writes out the trace through write, a chunk at a time. Recording is
+ * paused while this happens. */
+
+extern void trace_dump(void (*write)(const uint8* data, uint8 length), uint8 rows);
+
+#endif
@@ -0,0 +1,437 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ *
+ * Scripted typing through the simulated firmware (see sim.h), measuring
+ * what it looks like from the host:
+ *
+ *   - latency: every ordinary key is pressed at each point in the probe
+ *     cycle in turn, and the time from the key going down to the first
+ *     report carrying it being loaded into the endpoint is collected into a
+ *     histogram; and the same again for one key pressed after the scanner
+ *     has idled, which it has to wake up from first;
+ *
+ *   - rate: keys are typed at a fixed rate, each held for HOLD_MS, for a
+ *     series of rising rates, counting events dropped by the queue and
+ *     keystrokes the host never saw;
+ *
+ *   - rollover: n keys are pressed at once and let go one at a time, and
+ *     after each change the last report is checked against the keys down.
+ *
+ * The host asks for the report protocol, so built with REPORT_NKRO set the
+ * firmware sends NKRO reports and rollover should go to every key.
+ *
+ * Everything is deterministic. It exits with an error if any keystroke is
+ * lost at the rates typing actually reaches, or rollover goes wrong.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "project.h"
+#include "usbkeycodes.h"
+#include "keymap.h"
+#include "report.h"
+#include "perf.h"
+#include "sim.h"
+
+#define BUCKET_MS 1
+#define BUCKETS 20
+#define SEEN_TIMEOUT_MS 200
+#define SETTLE_MS 200
+#define IDLE_TIMEOUT_MS 5000
+#define HOLD_MS 30
+#define RATE_KEYSTROKES 1000
+#define TYPING_RATE 20 /* keystrokes a second a fast typist sustains */
+
+struct key
+{
+    uint8 position;
+    uint8 keycode;
+};
+
+/* What the host has been sent, and what it's waiting to see. */
+
+struct host_key
+{
+    bool down;
+    bool waiting;
+    uint64 pressed_cycles;
+};
+
+static struct key keys[KEYMAP_POSITIONS];
+static int num_keys;
+static struct host_key host[256];
+
+/* Either kind of report, as the host reads it. */
+
+struct host_report
+{
+    bool nkro;
+    bool rollover;
+    uint8 modifiers;
+    uint8 bitmap[REPORT_USAGES / 8];
+};
+
+static struct host_report last_loaded;
+static struct host_report last_report;
+static uint32 latency_buckets[BUCKETS];
+static uint64 latency_min = UINT64_MAX;
+static uint64 latency_max;
+static uint64 latency_total;
+static uint32 latency_count;
+static uint32 lost;
+static uint32 rollover_reports;
+static int failures;
+
+static bool is_modifier(uint8 keycode)
+{
+    return (keycode >= KEY_LeftControl) && (keycode <= KEY_RightGUI);
+}
+
+static bool in_report(const struct host_report* r, uint8 keycode)
+{
+    if (is_modifier(keycode))
+        return r->modifiers & (1 << (keycode - KEY_LeftControl));
+    return (keycode < REPORT_USAGES) && (r->bitmap[keycode >> 3] & (1 << (keycode & 7)));
+}
+
+static int keys_in_report(const struct host_report* r)
+{
+    int count = 0;
+    for (unsigned i=0; i<sizeof(r->bitmap); i++)
+        count += __builtin_popcount(r->bitmap[i]);
+    return count;
+}
+
+static void decode_report(struct host_report* r, const uint8* data, uint8 length)
+{
+    memset(r, 0, sizeof(*r));
+    r->modifiers = data[0];
+    if (length == sizeof(struct nkro_report))
+    {
+        const struct nkro_report* nkro = (const struct nkro_report*) data;
+        r->nkro = true;
+        memcpy(r->bitmap, nkro->bitmap, sizeof(r->bitmap));
+        return;
+    }
+
+    const struct boot_report* boot = (const struct boot_report*) data;
+    r->rollover = (boot->keys[0] == KEY_ErrorRollOver);
+    if (r->rollover)
+        return;
+    for (int i=0; i<6; i++)
+    {
+        uint8 keycode = boot->keys[i];
+        if (keycode && (keycode < REPORT_USAGES))
+            r->bitmap[keycode >> 3] |= 1 << (keycode & 7);
+    }
+}
+
+static void record_latency(uint64 cycles)
+{
+    uint32 bucket = cycles / (BUCKET_MS * SIM_CYCLES_PER_MS);
+    if (bucket >= BUCKETS)
+        bucket = BUCKETS - 1;
+    latency_buckets[bucket]++;
+    if (cycles < latency_min)
+        latency_min = cycles;
+    if (cycles > latency_max)
+        latency_max = cycles;
+    latency_total += cycles;
+    latency_count++;
+}
+
+/* A rollover report means the host keeps the keys it had. */
+
+static void report_loaded(uint64 cycles, const uint8* data, uint8 length)
+{
+    struct host_report r;
+    decode_report(&r, data, length);
+    last_loaded = r;
+    if (r.rollover)
+    {
+        rollover_reports++;
+        memcpy(r.bitmap, last_report.bitmap, sizeof(r.bitmap));
+    }
+    last_report = r;
+
+    for (int i=0; i<num_keys; i++)
+    {
+        struct host_key* k = &host[keys[i].keycode];
+        bool down = in_report(&r, keys[i].keycode);
+        if (down && !k->down && k->waiting)
+        {
+            record_latency(cycles - k->pressed_cycles);
+            k->waiting = false;
+        }
+        k->down = down;
+    }
+}
+
+static void press(const struct key* key, bool down)
+{
+    uint8 row = key->position >> 3;
+    uint8 bit = 1 << (key->position & 7);
+    if (down)
+    {
+        struct host_key* k = &host[key->keycode];
+        if (k->waiting)
+            lost++;
+        k->waiting = true;
+        k->pressed_cycles = sim_cycles();
+        sim_matrix[row] |= bit;
+    }
+    else
+        sim_matrix[row] &= ~bit;
+}
+
+static void run(int ms)
+{
+    while (ms--)
+        sim_step();
+}
+
+/* Lets everything go and waits for the host to catch up; anything it still
+ * hasn't seen by then has been lost. */
+
+static void settle(void)
+{
+    memset(sim_matrix, 0, sizeof(sim_matrix));
+    run(SETTLE_MS);
+    for (int i=0; i<num_keys; i++)
+    {
+        struct host_key* k = &host[keys[i].keycode];
+        if (k->waiting)
+            lost++;
+        k->waiting = false;
+    }
+}
+
+static void find_keys(void)
+{
+    for (int i=0; i<KEYMAP_POSITIONS; i++)
+    {
+        uint8 keycode = sim_plain_key(i);
+        if (!keycode)
+            continue;
+
+        /* Two keys with the same keycode look like one to the host. */
+
+        bool duplicate = false;
+        for (int j=0; j<num_keys; j++)
+            duplicate |= (keys[j].keycode == keycode);
+        if (duplicate)
+            continue;
+
+        keys[num_keys].position = i;
+        keys[num_keys].keycode = keycode;
+        num_keys++;
+    }
+}
+
+/* Presses the key at the given point in the probe cycle, and waits for the
+ * host to see it. Frames start every SIM_FRAME_MS from the start. */
+
+static void press_at(const struct key* key, int phase)
+{
+    while ((int) ((sim_cycles() / SIM_CYCLES_PER_MS) % SIM_FRAME_MS) != phase)
+        sim_step();
+
+    press(key, true);
+    for (int t=0; host[key->keycode].waiting && (t<SEEN_TIMEOUT_MS); t++)
+        sim_step();
+    run(HOLD_MS);
+    press(key, false);
+    run(SETTLE_MS);
+}
+
+static void print_latency(const char* title)
+{
+    if (latency_count)
+        printf("%s, key down to report loaded: n=%lu min=%luus avg=%luus max=%luus\n",
+            title, (unsigned long) latency_count,
+            (unsigned long) (latency_min / SIM_CYCLES_PER_US),
+            (unsigned long) (latency_total / latency_count / SIM_CYCLES_PER_US),
+            (unsigned long) (latency_max / SIM_CYCLES_PER_US));
+    else
+        printf("%s: no presses seen\n", title);
+    for (int i=0; i<BUCKETS; i++)
+    {
+        if (!latency_buckets[i])
+            continue;
+        if (i == (BUCKETS-1))
+            printf("  >=%dms: %lu\n", i*BUCKET_MS, (unsigned long) latency_buckets[i]);
+        else
+            printf("  %d-%dms: %lu\n", i*BUCKET_MS, (i+1)*BUCKET_MS,
+                (unsigned long) latency_buckets[i]);
+    }
+    if (lost)
+    {
+        printf("  %lu presses lost\n", (unsigned long) lost);
+        failures++;
+    }
+
+    memset(latency_buckets, 0, sizeof(latency_buckets));
+    latency_min = UINT64_MAX;
+    latency_max = latency_total = latency_count = 0;
+    lost = 0;
+}
+
+static void latency(void)
+{
+    for (int i=0; i<num_keys; i++)
+        for (int phase=0; phase<SIM_FRAME_MS; phase++)
+            press_at(&keys[i], phase);
+    settle();
+    print_latency("latency");
+}
+
+static void wake(void)
+{
+    for (int phase=0; phase<SIM_FRAME_MS; phase++)
+    {
+        for (int t=0; !sim_idle() && (t<IDLE_TIMEOUT_MS); t++)
+            sim_step();
+        if (!sim_idle())
+        {
+            printf("latency from idle: the scanner never idled\n");
+            failures++;
+            return;
+        }
+        press_at(&keys[0], phase);
+    }
+    settle();
+    print_latency("latency from idle");
+}
+
+/* Keystroke n goes down at n*interval_ms and up HOLD_MS later. The keys
+ * are used in a fixed scrambled order. */
+
+static void rate(void)
+{
+    static const int intervals[] = { 50, 40, 30, 25, 20, 15, 12, 10, 8, 6, 5, 4, 3, 2, 1 };
+    int best = 0;
+
+    printf("rate, %dms holds, %d keystrokes each:\n", HOLD_MS, RATE_KEYSTROKES);
+    for (unsigned i=0; i<(sizeof(intervals)/sizeof(*intervals)); i++)
+    {
+        int interval = intervals[i];
+        lost = 0;
+        rollover_reports = 0;
+        perf.events_dropped = 0;
+        perf.queue_high_water = 0;
+
+        int length = (RATE_KEYSTROKES-1)*interval + HOLD_MS + 1;
+        for (int t=0; t<length; t++)
+        {
+            if (!(t % interval) && ((t / interval) < RATE_KEYSTROKES))
+                press(&keys[((t / interval) * 7) % num_keys], true);
+            if ((t >= HOLD_MS) && !((t - HOLD_MS) % interval))
+                press(&keys[(((t - HOLD_MS) / interval) * 7) % num_keys], false);
+            sim_step();
+        }
+        settle();
+
+        int per_second = 1000 / interval;
+        printf("  %4d/s: queue high=%lu dropped=%lu, %lu rollover reports, %lu keystrokes lost\n",
+            per_second, (unsigned long) perf.queue_high_water, (unsigned long) perf.events_dropped,
+            (unsigned long) rollover_reports, (unsigned long) lost);
+        if (!perf.events_dropped && !lost && (per_second > best))
+            best = per_second;
+    }
+    printf("  highest rate with nothing lost: %d/s\n", best);
+    if (best < TYPING_RATE)
+        failures++;
+}
+
+/* Checks the last report loaded against the keys held down. Only
+ * non-modifiers count against the boot report's six slots; an NKRO report
+ * has room for them all. */
+
+static bool check_rollover(const struct key* held, int count)
+{
+    const struct host_report* r = &last_loaded;
+    int down = 0;
+    for (int i=0; i<count; i++)
+    {
+        if (!is_modifier(held[i].keycode))
+            down++;
+        else if (!in_report(r, held[i].keycode))
+            return false;
+    }
+
+    if (!r->nkro && (down > 6))
+        return r->rollover;
+    if (r->rollover)
+        return false;
+
+    for (int i=0; i<count; i++)
+        if (!is_modifier(held[i].keycode) && !in_report(r, held[i].keycode))
+            return false;
+    return keys_in_report(r) == down;
+}
+
+static void rollover(void)
+{
+    printf("rollover:\n");
+    for (int n=1; n<=10; n++)
+    {
+        struct key held[10];
+        for (int i=0; i<n; i++)
+        {
+            held[i] = keys[(i * 7) % num_keys];
+            press(&held[i], true);
+        }
+        run(SETTLE_MS);
+
+        bool ok = check_rollover(held, n);
+        for (int i=0; i<n; i++)
+        {
+            press(&held[i], false);
+            run(SETTLE_MS);
+            ok &= check_rollover(&held[i+1], n-i-1);
+        }
+        settle();
+        printf("  %2d keys: %s\n", n, ok ? "ok" : "FAILED");
+        if (!ok)
+            failures++;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int poll_ms = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                poll_ms = atoi(optarg);
+                if ((poll_ms >= 1) && (poll_ms <= 255))
+                    break;
+                /* fall through */
+            default:
+                fprintf(stderr, "usage: bench [-p poll_ms]\n");
+                exit(1);
+        }
+    }
+
+    sim_init(poll_ms, report_loaded);
+    find_keys();
+    printf("bench: %d keys, host polls every %dms, %s reports\n", num_keys, poll_ms,
+        REPORT_NKRO ? "NKRO" : "boot");
+
+    latency();
+    wake();
+    rate();
+    rollover();
+
+    if (failures)
+    {
+        printf("bench: failed\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,113 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ *
+ * Host test for frame.c, against synthetic frames.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "frame.h"
+
+static int failures;
+
+#define CHECK(e) \
+    do { if (!(e)) { printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #e); failures++; } } while (0)
+
+static union frame blank(void)
+{
+    union frame f;
+    memset(&f, 0, sizeof(f));
+    return f;
+}
+
+static void test_diff(void)
+{
+    union frame a = blank();
+    union frame b = blank();
+    CHECK(frame_diff(&a, &b) == 0);
+
+    /* Every row on its own, in every column. */
+
+    for (int y=0; y<FRAME_ROWS; y++)
+        for (int x=0; x<8; x++)
+        {
+            b = blank();
+            b.rows[y] = 1 << x;
+            CHECK(frame_diff(&a, &b) == (1 << y));
+            CHECK(frame_diff(&b, &a) == (1 << y));
+        }
+
+    /* Several rows at once, in different words. */
+
+    b = blank();
+    b.rows[0] = 0x80;
+    b.rows[3] = 0x01;
+    b.rows[4] = 0xff;
+    b.rows[9] = 0x10;
+    CHECK(frame_diff(&a, &b) == ((1<<0) | (1<<3) | (1<<4) | (1<<9)));
+
+    /* Rows which are the same in both aren't reported, however full. */
+
+    a.rows[4] = 0xff;
+    CHECK(frame_diff(&a, &b) == ((1<<0) | (1<<3) | (1<<9)));
+
+    /* The padding past the last row never counts. */
+
+    a = blank();
+    b = blank();
+    for (int i=FRAME_ROWS; i<(FRAME_WORDS * 4); i++)
+        b.rows[i] = 0xff;
+    CHECK(frame_diff(&a, &b) == 0);
+}
+
+static void test_ghosted(void)
+{
+    const uint8_t matrix_rows = FRAME_ROWS - 1;
+    union frame f = blank();
+    CHECK(!frame_ghosted(&f, matrix_rows));
+
+    /* One key per row, even all in the same column, can't ghost. */
+
+    for (int y=0; y<matrix_rows; y++)
+        f.rows[y] = 0x04;
+    CHECK(!frame_ghosted(&f, matrix_rows));
+
+    /* Nor can a whole row held down on its own. */
+
+    f = blank();
+    f.rows[2] = 0xff;
+    CHECK(!frame_ghosted(&f, matrix_rows));
+
+    /* Two rows sharing one column is fine; sharing two is a rectangle. */
+
+    f = blank();
+    f.rows[1] = 0x03;
+    f.rows[6] = 0x06;
+    CHECK(!frame_ghosted(&f, matrix_rows));
+    f.rows[6] = 0x07;
+    CHECK(frame_ghosted(&f, matrix_rows));
+
+    /* The first and last matrix rows are both looked at. */
+
+    f = blank();
+    f.rows[0] = 0x81;
+    f.rows[matrix_rows-1] = 0x81;
+    CHECK(frame_ghosted(&f, matrix_rows));
+
+    /* Rows past matrix_rows (the modifier register) are not. */
+
+    f = blank();
+    f.rows[0] = 0x81;
+    f.rows[matrix_rows] = 0x81;
+    CHECK(!frame_ghosted(&f, matrix_rows));
+}
+
+int main(void)
+{
+    test_diff();
+    test_ghosted();
+    printf("frametest: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,124 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ *
+ * Stands in for the project.h which PSoC Creator generates, so that the
+ * firmware can be built on the host. The types and macros are the ones the
+ * firmware uses; the component APIs are implemented by sim.c, against a
+ * simulated matrix, USB host and clock. Only the CPU scan path is
+ * simulated, so there's no SenseDMA or SenseInterrupt here.
+ */
+
+#ifndef PROJECT_H
+#define PROJECT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef uint64_t uint64;
+typedef int8_t int8;
+typedef int16_t int16;
+typedef int32_t int32;
+typedef uint32 cystatus;
+typedef void (*cyisraddress)(void);
+
+#define CY_ISR(name) void name(void)
+#define CY_ALIGN(n) __attribute__((aligned(n)))
+#define CyGlobalIntEnable
+#define __DMB() __sync_synchronize()
+#define __WFI()
+
+#define BCLK__BUS_CLK__HZ 64000000u
+
+/* The host runs everything on one thread, so interrupts can't happen in
+ * critical sections anyway. */
+
+static inline uint8 CyEnterCriticalSection(void)
+{
+    return 0;
+}
+
+static inline void CyExitCriticalSection(uint8 state)
+{
+    (void) state;
+}
+
+extern void CyDelay(uint32 ms);
+extern void CySysTickStart(void);
+extern cyisraddress CySysTickSetCallback(uint32 number, cyisraddress function);
+
+/* The DWT cycle counter is the simulated clock. */
+
+typedef struct
+{
+    volatile uint32 CTRL;
+    volatile uint32 CYCCNT;
+} DWT_Type;
+
+typedef struct
+{
+    volatile uint32 DEMCR;
+} CoreDebug_Type;
+
+#define DWT_CTRL_CYCCNTENA_Msk 1u
+#define CoreDebug_DEMCR_TRCENA_Msk (1u << 24)
+
+extern DWT_Type* const DWT;
+extern CoreDebug_Type* const CoreDebug;
+
+/* Scanner */
+
+extern void LedReg_Write(uint8 value);
+extern uint8 ProbeReg_Read(void);
+extern uint8 SenseReg_Read(void);
+extern uint8 ModifierReg_Read(void);
+extern void ProbeCounter_Start(void);
+extern void ProbeInterrupt_StartEx(cyisraddress address);
+extern void ProbeInterrupt_Enable(void);
+extern void ProbeInterrupt_Disable(void);
+
+/* USB */
+
+/* As in both boards' schematics: there's no SOF interrupt, and reports
+ * are sent from the main loop. */
+
+#ifndef USBFS_SOF_ISR_REMOVE
+#define USBFS_SOF_ISR_REMOVE 1
+#endif
+
+#define USBFS_DWR_VDDD_OPERATION 0
+#define USBFS_PROTOCOL_BOOT 0
+#define USBFS_PROTOCOL_REPORT 1
+#define USBFS_FORCE_K 0x80
+#define USBFS_FORCE_NONE 0
+
+extern void USBFS_Start(uint8 device, uint8 mode);
+extern uint8 USBFS_GetConfiguration(void);
+extern uint8 USBFS_IsConfigurationChanged(void);
+extern void USBFS_EnableOutEP(uint8 ep);
+extern void USBFS_LoadInEP(uint8 ep, const uint8* data, uint16 length);
+extern uint8 USBFS_GetEPAckState(uint8 ep);
+extern uint8 USBFS_GetProtocol(uint8 interface);
+extern uint8 USBFS_CheckActivity(void);
+extern void USBFS_Suspend(void);
+extern void USBFS_Resume(void);
+extern uint8 USBFS_RWUEnabled(void);
+extern void USBFS_Force(uint8 state);
+
+/* UART */
+
+#define UART_TX_STS_FIFO_NOT_FULL 0x08
+
+extern void UART_Start(void);
+extern void UART_PutString(const char* s);
+extern void UART_PutChar(uint8 c);
+extern void UART_PutArray(const uint8* data, uint8 length);
+extern uint8 UART_GetChar(void);
+extern uint8 UART_GetRxBufferSize(void);
+extern uint8 UART_ReadRxData(void);
+extern uint8 UART_ReadTxStatus(void);
+extern void UART_WriteTxData(uint8 c);
+
+#endif
@@ -0,0 +1,197 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ *
+ * Replays a scan trace (see trace.h), as dumped by the keyboard's d
+ * command, through the simulated firmware, and prints every report it
+ * sends the host and the performance counters at the end. Each trace entry
+ * is applied to the matrix at the start of the frame it was recorded in,
+ * so the scanner sees the same raw changes on the same passes as the
+ * keyboard did, and a replay always gives the same output. The trace the
+ * simulated firmware records while replaying is then checked against the
+ * one that went in.
+ *
+ * The keyboard's ring only holds the most recent TRACE_ENTRIES changes, so
+ * a trace taken after it has wrapped may start with keys already held down;
+ * those won't round-trip.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "project.h"
+#include "trace.h"
+#include "perf.h"
+#include "sim.h"
+
+/* After the last entry, enough frames for the debounce, tap-hold and
+ * combo timers to run out. */
+
+#define SETTLE_FRAMES 50
+
+struct trace
+{
+    struct trace_header header;
+    struct trace_entry entries[TRACE_ENTRIES];
+};
+
+static struct trace input;
+static struct trace output;
+static uint32 output_length;
+static uint64 frames;
+
+static void print_time(void)
+{
+    uint64 us = sim_cycles() / SIM_CYCLES_PER_US;
+    printf("%8lu.%03lu ", (unsigned long) (us / 1000), (unsigned long) (us % 1000));
+}
+
+static void print_report(uint64 cycles, const uint8* data, uint8 length)
+{
+    print_time();
+    printf("report");
+    for (int i=0; i<length; i++)
+        printf(" %02x", data[i]);
+    printf("\n");
+}
+
+static void print_line(const char* s)
+{
+    /* The firmware's lines end in CR LF. */
+
+    printf("%.*s\n", (int) strcspn(s, "\r\n"), s);
+}
+
+static void capture(const uint8* data, uint8 length)
+{
+    if ((output_length + length) <= sizeof(output))
+        memcpy((uint8*) &output + output_length, data, length);
+    output_length += length;
+}
+
+static void run_frame(void)
+{
+    for (int i=0; i<SIM_FRAME_MS; i++)
+        sim_step();
+    frames++;
+}
+
+/* The time-only entries a trace starts with just say how long the keyboard
+ * had been running, so they are skipped. */
+
+static const struct trace_entry* first_change(const struct trace* t, uint16* count)
+{
+    const struct trace_entry* e = t->entries;
+    *count = t->header.count;
+    while (*count && (e->row == TRACE_ROW_TIME))
+    {
+        e++;
+        (*count)--;
+    }
+    return e;
+}
+
+static uint32 load(const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+    {
+        perror(filename);
+        exit(1);
+    }
+    size_t length = fread(&input, 1, sizeof(input), f);
+    fclose(f);
+
+    const struct trace_header* h = &input.header;
+    if ((length < sizeof(*h)) || memcmp(h->magic, "KTRC", 4))
+    {
+        fprintf(stderr, "%s: not a scan trace\n", filename);
+        exit(1);
+    }
+    if ((h->version != TRACE_VERSION) || (h->rows != SIM_ROWS) || (h->count > TRACE_ENTRIES))
+    {
+        fprintf(stderr, "%s: version %d, %d rows: not a maxii-keyboard trace this can replay\n",
+            filename, h->version, h->rows);
+        exit(1);
+    }
+    if (length != (sizeof(*h) + h->count*sizeof(struct trace_entry)))
+    {
+        fprintf(stderr, "%s: expected %d entries\n", filename, h->count);
+        exit(1);
+    }
+    return length;
+}
+
+int main(int argc, char* argv[])
+{
+    int poll_ms = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                poll_ms = atoi(optarg);
+                if ((poll_ms >= 1) && (poll_ms <= 255))
+                    break;
+                /* fall through */
+            default:
+                fprintf(stderr, "usage: replay [-p poll_ms] trace.ktrc\n");
+                exit(1);
+        }
+    }
+    if (optind != (argc-1))
+    {
+        fprintf(stderr, "usage: replay [-p poll_ms] trace.ktrc\n");
+        exit(1);
+    }
+
+    uint32 length = load(argv[optind]);
+    sim_init(poll_ms, print_report);
+
+    /* The first change is put in frame 1, the first pass the simulation
+     * counts, and each one after it delta frames after the one before. */
+
+    uint16 in_count;
+    const struct trace_entry* in = first_change(&input, &in_count);
+    uint64 frame = 1;
+    for (int i=0; i<in_count; i++)
+    {
+        const struct trace_entry* e = &in[i];
+        if (i)
+            frame += e->delta;
+        while (frames < (frame-1))
+            run_frame();
+
+        if (e->row != TRACE_ROW_TIME)
+        {
+            print_time();
+            printf("row %d = %02x\n", e->row, e->sense);
+            sim_matrix[e->row] = e->sense;
+        }
+    }
+    for (int i=0; i<SETTLE_FRAMES; i++)
+        run_frame();
+
+    perf_dump(print_line, sim_cycles() / SIM_CYCLES_PER_MS);
+
+    /* The first change's delta depends on where the original trace
+     * started, so only its row and sense are compared. */
+
+    trace_dump(capture, SIM_ROWS);
+    uint16 out_count;
+    const struct trace_entry* out = first_change(&output, &out_count);
+
+    bool same = (output_length <= sizeof(output)) && (in_count == out_count);
+    for (int i=1; same && (i<in_count); i++)
+        same = !memcmp(&in[i], &out[i], sizeof(*in));
+    if (in_count && same)
+        same = (in[0].row == out[0].row) && (in[0].sense == out[0].sense);
+    if (!same)
+    {
+        fprintf(stderr, "%s: the replay's trace doesn't match (%u bytes in, %lu out)\n",
+            argv[optind], (unsigned) length, (unsigned long) output_length);
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,230 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ *
+ * The simulated hardware behind sim.h. main.c is included here, rather than
+ * linked, so that its interrupt handlers and main loop can be driven
+ * directly; its main() is never called.
+ */
+
+#define main firmware_main
+#include "main.c"
+#undef main
+
+#include "sim.h"
+
+#define TICK_PHASE_US 0
+#define PROBE_PHASE_US 100
+#define SOF_PHASE_US 500
+#define POLL_PHASE_US 600
+
+uint8 sim_matrix[SIM_ROWS];
+
+static struct
+{
+    uint64 ms;
+    uint64 cycles;
+    uint8 probe;
+    bool probe_enabled;
+    uint8 poll_ms;
+    sim_load_t* load;
+    bool configured;
+    bool config_changed;
+    bool ep_acked;
+} hw;
+
+static DWT_Type dwt;
+static CoreDebug_Type core_debug;
+DWT_Type* const DWT = &dwt;
+CoreDebug_Type* const CoreDebug = &core_debug;
+
+void CyDelay(uint32 ms) {}
+void CySysTickStart(void) {}
+cyisraddress CySysTickSetCallback(uint32 number, cyisraddress function) { return NULL; }
+
+void LedReg_Write(uint8 value) {}
+void ProbeCounter_Start(void) {}
+void ProbeInterrupt_StartEx(cyisraddress address) { hw.probe_enabled = true; }
+void ProbeInterrupt_Enable(void) { hw.probe_enabled = true; }
+void ProbeInterrupt_Disable(void) { hw.probe_enabled = false; }
+
+uint8 ProbeReg_Read(void)
+{
+    return hw.probe;
+}
+
+uint8 SenseReg_Read(void)
+{
+    return sim_matrix[hw.probe];
+}
+
+uint8 ModifierReg_Read(void)
+{
+    return ~sim_matrix[MODIFIER_ROW]; /* active low */
+}
+
+void USBFS_Start(uint8 device, uint8 mode)
+{
+    hw.configured = true;
+    hw.config_changed = true;
+}
+
+uint8 USBFS_GetConfiguration(void)
+{
+    return hw.configured;
+}
+
+uint8 USBFS_IsConfigurationChanged(void)
+{
+    bool changed = hw.config_changed;
+    hw.config_changed = false;
+    return changed;
+}
+
+void USBFS_EnableOutEP(uint8 ep) {}
+
+void USBFS_LoadInEP(uint8 ep, const uint8* data, uint16 length)
+{
+    hw.ep_acked = false;
+    if (hw.load)
+        hw.load(hw.cycles, data, length);
+}
+
+uint8 USBFS_GetEPAckState(uint8 ep)
+{
+    return hw.ep_acked;
+}
+
+/* The host stays with the report protocol, which is what every HID device
+ * starts in; only a BIOS asks for the boot protocol. */
+
+uint8 USBFS_GetProtocol(uint8 interface)
+{
+    return USBFS_PROTOCOL_REPORT;
+}
+
+uint8 USBFS_CheckActivity(void) { return true; }
+void USBFS_Suspend(void) {}
+void USBFS_Resume(void) {}
+uint8 USBFS_RWUEnabled(void) { return false; }
+void USBFS_Force(uint8 state) {}
+
+/* Nothing comes in on the serial port, and what goes out is thrown away;
+ * the tools call the firmware's dump functions directly. */
+
+void UART_Start(void) {}
+void UART_PutString(const char* s) {}
+void UART_PutChar(uint8 c) {}
+void UART_PutArray(const uint8* data, uint8 length) {}
+uint8 UART_GetChar(void) { return 0; }
+uint8 UART_GetRxBufferSize(void) { return 0; }
+uint8 UART_ReadRxData(void) { return 0; }
+uint8 UART_ReadTxStatus(void) { return UART_TX_STS_FIFO_NOT_FULL; }
+void UART_WriteTxData(uint8 c) {}
+
+/* Keymap uploads aren't simulated, so the built-in keymap is always used. */
+
+bool mapstore_init(void)
+{
+    return false;
+}
+
+bool mapstore_begin(void)
+{
+    return false;
+}
+
+uint8 mapstore_put(uint8 byte)
+{
+    return MAPSTORE_FAILED;
+}
+
+/* The body of main()'s loop, without the serial port commands. */
+
+static void main_loop(void)
+{
+    usb_poll();
+#if USBFS_SOF_ISR_REMOVE
+    report_poll();
+#endif
+    eventlog_drain();
+    selftest_poll(print);
+}
+
+static void at(uint32 us)
+{
+    hw.cycles = (hw.ms * SIM_CYCLES_PER_MS) + (us * SIM_CYCLES_PER_US);
+    DWT->CYCCNT = hw.cycles;
+}
+
+void sim_init(uint8 poll_ms, sim_load_t* load)
+{
+    hw.poll_ms = poll_ms;
+    hw.load = load;
+    hw.ep_acked = true;
+    at(0);
+
+    /* As main(), up to its loop. */
+
+    perf_init();
+    USBFS_Start(0, USBFS_DWR_VDDD_OPERATION);
+    combo_init(combos, NUM_COMBOS, post_keyevent);
+    if (!mapstore_init())
+        keymap_init(&base_layer, overlays, NUM_OVERLAYS, tapholds, NUM_TAPHOLDS);
+    for (int i=0; i<NUM_ROWS; i++)
+        debounce_init(&debounce[i], debounce_config[i]);
+    ProbeCounter_Start();
+    capture_start();
+    ProbeInterrupt_StartEx(&ProbeInterrupt);
+    idle_start();
+    main_loop();
+}
+
+void sim_step(void)
+{
+    at(TICK_PHASE_US);
+    clock_tick();
+    main_loop();
+
+    at(PROBE_PHASE_US);
+    if (hw.probe_enabled)
+        ProbeInterrupt();
+    hw.probe = (hw.probe + 1) % MATRIX_ROWS;
+    main_loop();
+
+    at(SOF_PHASE_US);
+#if !USBFS_SOF_ISR_REMOVE
+    USBFS_SOF_ISR_EntryCallback();
+#endif
+    main_loop();
+
+    at(POLL_PHASE_US);
+    if (!(hw.ms % hw.poll_ms) && !hw.ep_acked)
+    {
+        hw.ep_acked = true;
+        USBFS_EP_1_ISR_EntryCallback();
+        main_loop();
+    }
+
+    hw.ms++;
+    at(0);
+}
+
+uint64 sim_cycles(void)
+{
+    return hw.cycles;
+}
+
+bool sim_idle(void)
+{
+    return idle;
+}
+
+uint8 sim_plain_key(uint8 position)
+{
+    uint8 row = position >> 3;
+    uint8 column = position & 7;
+    uint8 keycode = base_layer[row][column];
+    if ((combo_used(row) & (1 << column)) || (keycode >= KEY_Trans))
+        return 0;
+    return keycode;
+}
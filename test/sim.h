@@ -0,0 +1,58 @@
+/* maxii-keyboard firmware
+ * (C) 2017 David Given
+ *
+ * A simulated maxii-keyboard: main.c, built as it is against the project.h
+ * in this directory, with the hardware it talks to simulated here.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+/* Time moves on a millisecond per sim_step(). In each millisecond SysTick
+ * fires, then ProbeInterrupt reads the next probe line (and the modifier
+ * register with the last one), then the USB SOF arrives, and then, if this
+ * is one of its polls, the host takes whatever report is waiting in the
+ * endpoint. The main loop runs after each of these. A frame is MATRIX_ROWS
+ * probe lines, so the first sim_step() after sim_init(), and every
+ * SIM_FRAME_MS after that, starts a new frame. Times are kept in CPU
+ * cycles, as the firmware sees them through the cycle counter. */
+
+#define SIM_ROWS 10
+#define SIM_FRAME_MS 9
+#define SIM_CYCLES_PER_US (BCLK__BUS_CLK__HZ / 1000000)
+#define SIM_CYCLES_PER_MS (BCLK__BUS_CLK__HZ / 1000)
+
+/* Which keys are physically down, a byte per row with a set bit meaning
+ * pressed, laid out like the keymap (so the last row is the modifier
+ * register). */
+
+extern uint8 sim_matrix[SIM_ROWS];
+
+/* Called whenever the firmware loads a report into the endpoint. */
+
+typedef void sim_load_t(uint64 cycles, const uint8* data, uint8 length);
+
+/* Starts the firmware, as main() does, and brings USB up. The host polls
+ * the endpoint every poll_ms milliseconds (its bInterval). This can only
+ * be done once. */
+
+extern void sim_init(uint8 poll_ms, sim_load_t* load);
+
+extern void sim_step(void);
+
+/* The time now, and at the start of the next sim_step(). */
+
+extern uint64 sim_cycles(void);
+
+/* Whether the firmware has idled the scanner, which it does after a couple
+ * of seconds with nothing held down. */
+
+extern bool sim_idle(void);
+
+/* Returns the keycode the built-in keymap gives the key at position if
+ * it's an ordinary key, sent as soon as it's pressed, or 0 if it does
+ * nothing, is a tap-hold or layer key, or is in a combo. */
+
+extern uint8 sim_plain_key(uint8 position);
+
+#endif
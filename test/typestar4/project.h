@@ -0,0 +1,137 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ *
+ * Stands in for the project.h which PSoC Creator generates, so that the
+ * firmware can be built on the host. The types and macros are the ones the
+ * firmware uses; the component APIs are implemented by sim.c, against a
+ * simulated matrix, LCD, USB host and clock.
+ */
+
+#ifndef PROJECT_H
+#define PROJECT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint32_t cystatus;
+typedef void (*cyisraddress)(void);
+
+#define CY_ISR(name) void name(void)
+#define CY_ALIGN(n) __attribute__((aligned(n)))
+#define CyGlobalIntEnable
+#define __DMB() __sync_synchronize()
+
+#define BCLK__BUS_CLK__HZ 64000000u
+
+/* Interrupts only arrive while the firmware is waiting for something (see
+ * sim.h), which it never does in a critical section. */
+
+static inline uint8_t CyEnterCriticalSection(void)
+{
+    return 0;
+}
+
+static inline void CyExitCriticalSection(uint8_t state)
+{
+    (void) state;
+}
+
+extern void CyDelay(uint32_t ms);
+extern void CyDelayUs(uint16_t us);
+extern void sim_wait_for_interrupt(void);
+
+#define __WFI() sim_wait_for_interrupt()
+
+/* SysTick, which drives the scanner. */
+
+extern void CySysTickStart(void);
+extern cyisraddress CySysTickSetCallback(uint32_t number, cyisraddress function);
+extern void CySysTickSetReload(uint32_t value);
+extern void CySysTickClear(void);
+
+/* The DWT cycle counter is the simulated clock. */
+
+typedef struct
+{
+    volatile uint32_t CTRL;
+    volatile uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct
+{
+    volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+#define DWT_CTRL_CYCCNTENA_Msk 1u
+#define CoreDebug_DEMCR_TRCENA_Msk (1u << 24)
+
+extern DWT_Type* const DWT;
+extern CoreDebug_Type* const CoreDebug;
+
+/* Matrix */
+
+#define KBDSENSE_DM_RES_DWN 3
+#define KBDSENSE_DM_STRONG 6
+#define MODIFIERS_DM_RES_DWN 3
+#define MODIFIERS_DM_STRONG 6
+
+extern void KBDPROBE_Write(uint8_t value);
+extern uint8_t KBDSENSE_Read(void);
+extern void KBDSENSE_Write(uint8_t value);
+extern void KBDSENSE_SetDriveMode(uint8_t mode);
+extern uint8_t MODIFIERS_Read(void);
+extern void MODIFIERS_Write(uint8_t value);
+extern void MODIFIERS_SetDriveMode(uint8_t mode);
+extern void LED_Write(uint8_t value);
+
+/* LCD */
+
+enum
+{
+    LCDCTRL_E,
+    LCDCTRL_RS,
+    LCDCTRL_RW
+};
+
+extern void LCDDATA_Write(uint8_t value);
+extern void CyPins_SetPin(int pin);
+extern void CyPins_ClearPin(int pin);
+
+/* USB */
+
+/* As in the board's schematic: there's no SOF interrupt, and reports are
+ * sent from the main loop. */
+
+#ifndef USBFS_SOF_ISR_REMOVE
+#define USBFS_SOF_ISR_REMOVE 1
+#endif
+
+#define USBFS_DWR_POWER_OPERATION 2
+#define USBFS_PROTOCOL_BOOT 0
+#define USBFS_PROTOCOL_REPORT 1
+#define USBFS_FORCE_K 0x80
+#define USBFS_FORCE_NONE 0
+
+extern void USBFS_Start(uint8_t device, uint8_t mode);
+extern uint8_t USBFS_GetConfiguration(void);
+extern uint8_t USBFS_IsConfigurationChanged(void);
+extern void USBFS_EnableOutEP(uint8_t ep);
+extern void USBFS_LoadInEP(uint8_t ep, const uint8_t* data, uint16_t length);
+extern uint8_t USBFS_GetEPAckState(uint8_t ep);
+extern uint8_t USBFS_GetProtocol(uint8_t interface);
+extern uint8_t USBFS_CheckActivity(void);
+extern void USBFS_Suspend(void);
+extern void USBFS_Resume(void);
+extern uint8_t USBFS_RWUEnabled(void);
+extern void USBFS_Force(uint8_t state);
+
+/* USB CDC */
+
+extern uint8_t USBFS_CDC_Init(void);
+extern uint8_t USBFS_CDCIsReady(void);
+extern void USBFS_PutData(const uint8_t* data, uint16_t length);
+extern uint8_t USBFS_DataIsReady(void);
+extern uint16_t USBFS_GetCount(void);
+extern uint16_t USBFS_GetData(uint8_t* data, uint16_t length);
+
+#endif
@@ -0,0 +1,626 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ *
+ * The simulated hardware behind sim.h. main.c is included here, rather than
+ * linked, so that its interrupt handlers and main loop can be driven
+ * directly; its main() is never called.
+ */
+
+#define main firmware_main
+#include "main.c"
+#undef main
+
+#include "sim.h"
+
+/* A sense line left floating falls through its pull-down in
+ * SENSE_FALL_US(row) with one probe line driven, more slowly with them all
+ * driven, as for the modifiers row or while idle; the modifier lines have
+ * their own, slower, pull-downs. A pin read takes READ_CYCLES, as does
+ * checking whether the CDC endpoint is free, so that busy loops see time
+ * go by. */
+
+#define SENSE_FALL_US(row) (10 + (row))
+#define SENSE_ALL_FALL_US 20
+#define MODIFIERS_FALL_US 25
+#define READ_CYCLES 4
+
+/* The HD44780's worst-case execution times, and how long it needs after
+ * power-up before it takes anything. E has to be high for at least 230ns
+ * for a byte to be latched on its falling edge. */
+
+#define LCD_POWER_UP_MS 40
+#define LCD_SLOW_US 1520
+#define LCD_FAST_US 37
+#define LCD_PULSE_CYCLES 15
+
+#define CDC_HOST_BUFFER 4096
+
+uint8_t sim_matrix[SIM_ROWS];
+
+/* A port's pins: what's written to them and how they're driven, and any
+ * charge left on them which the pull-downs haven't yet drained. */
+
+struct pins
+{
+    bool strong;
+    uint8_t written;
+    uint8_t charge;
+    uint64_t falls;
+};
+
+struct ring
+{
+    char data[CDC_HOST_BUFFER];
+    uint16_t head;
+    uint16_t tail;
+};
+
+static struct
+{
+    uint64_t cycles;
+    bool in_interrupt;
+
+    cyisraddress tick_callback;
+    bool tick_enabled;
+    uint32_t tick_reload;
+    uint64_t tick_due;
+
+    uint64_t usb_due;
+    bool usb_sof;
+    uint64_t frame;
+    uint64_t configure_cycles;
+    uint8_t poll_ms;
+    sim_load_t* load;
+    bool configured;
+    bool config_changed;
+    bool ep_acked;
+
+    uint8_t probe;
+    struct pins sense;
+    struct pins modifiers;
+
+    uint8_t lcd_data;
+    bool lcd_e;
+    bool lcd_rs;
+    bool lcd_rw;
+    uint64_t lcd_e_cycles;
+    uint64_t lcd_ready;
+    uint8_t lcd_address;
+    uint32_t lcd_errors;
+    char ddram[128];
+
+    uint8_t cdc_in[CDC_PACKET_SIZE];
+    uint16_t cdc_in_length;
+    uint8_t cdc_out[CDC_PACKET_SIZE];
+    uint16_t cdc_out_length;
+    struct ring to_device;
+    struct ring from_device;
+} hw;
+
+static DWT_Type dwt;
+static CoreDebug_Type core_debug;
+DWT_Type* const DWT = &dwt;
+CoreDebug_Type* const CoreDebug = &core_debug;
+
+static void set_time(uint64_t cycles)
+{
+    hw.cycles = cycles;
+    DWT->CYCCNT = cycles;
+}
+
+static void usb_event(void);
+
+static uint64_t next_interrupt(void)
+{
+    if (hw.tick_enabled && (hw.tick_due < hw.usb_due))
+        return hw.tick_due;
+    return hw.usb_due;
+}
+
+/* SysTick reloads from LOAD as it wraps, before its interrupt runs, so the
+ * value set by the last interrupt is the one which counts. */
+
+static void take_interrupt(void)
+{
+    hw.in_interrupt = true;
+    if (hw.tick_enabled && (hw.tick_due <= hw.usb_due))
+    {
+        hw.tick_due += hw.tick_reload + 1;
+        if (hw.tick_callback)
+            hw.tick_callback();
+    }
+    else
+        usb_event();
+    hw.in_interrupt = false;
+}
+
+/* Moves time on by cycles, taking each interrupt which comes due meanwhile
+ * as it does, unless already in one; an interrupt which comes due while
+ * another is running is taken, late, when that one finishes. */
+
+static void spend(uint64_t cycles)
+{
+    uint64_t until = hw.cycles + cycles;
+    while (!hw.in_interrupt)
+    {
+        uint64_t due = next_interrupt();
+        if ((due > until) && (due > hw.cycles))
+            break;
+        if (due > hw.cycles)
+            set_time(due);
+        take_interrupt();
+    }
+    if (until > hw.cycles)
+        set_time(until);
+}
+
+void sim_wait_for_interrupt(void)
+{
+    uint64_t due = next_interrupt();
+    spend((due > hw.cycles) ? (due - hw.cycles) : 0);
+}
+
+void CyDelay(uint32_t ms)
+{
+    spend((uint64_t) ms * SIM_CYCLES_PER_MS);
+}
+
+void CyDelayUs(uint16_t us)
+{
+    spend((uint64_t) us * SIM_CYCLES_PER_US);
+}
+
+void CySysTickStart(void)
+{
+    hw.tick_reload = SIM_CYCLES_PER_MS - 1;
+    hw.tick_due = hw.cycles + hw.tick_reload + 1;
+    hw.tick_enabled = true;
+}
+
+cyisraddress CySysTickSetCallback(uint32_t number, cyisraddress function)
+{
+    cyisraddress old = hw.tick_callback;
+    hw.tick_callback = function;
+    return old;
+}
+
+void CySysTickSetReload(uint32_t value)
+{
+    hw.tick_reload = value;
+}
+
+void CySysTickClear(void)
+{
+    hw.tick_due = hw.cycles + hw.tick_reload + 1;
+}
+
+void LED_Write(uint8_t value) {}
+
+/* The matrix. */
+
+static uint8_t sense_keys(void)
+{
+    uint8_t keys = 0;
+    for (int row=0; row<MODIFIER_ROW; row++)
+        if (hw.probe & (1 << row))
+            keys |= sim_matrix[row];
+    return keys;
+}
+
+static uint8_t modifier_keys(void)
+{
+    return hw.probe ? sim_matrix[MODIFIER_ROW] : 0;
+}
+
+static uint64_t sense_fall_cycles(void)
+{
+    if (hw.probe && !(hw.probe & (hw.probe - 1)))
+        return SENSE_FALL_US(__builtin_ctz(hw.probe)) * SIM_CYCLES_PER_US;
+    return SENSE_ALL_FALL_US * SIM_CYCLES_PER_US;
+}
+
+static uint8_t read_pins(const struct pins* p, uint8_t keys)
+{
+    if (p->strong)
+        return p->written;
+    if (hw.cycles < p->falls)
+        keys |= p->charge;
+    return keys;
+}
+
+/* Whatever the pins were at is left on them, to drain away. */
+
+static void float_pins(struct pins* p, uint8_t level, uint64_t fall_cycles)
+{
+    p->charge = level;
+    p->falls = hw.cycles + fall_cycles;
+}
+
+void KBDPROBE_Write(uint8_t value)
+{
+    uint8_t sense = read_pins(&hw.sense, sense_keys());
+    uint8_t modifiers = read_pins(&hw.modifiers, modifier_keys());
+    hw.probe = value;
+    float_pins(&hw.sense, sense, sense_fall_cycles());
+    float_pins(&hw.modifiers, modifiers, MODIFIERS_FALL_US * SIM_CYCLES_PER_US);
+}
+
+uint8_t KBDSENSE_Read(void)
+{
+    spend(READ_CYCLES);
+    return read_pins(&hw.sense, sense_keys());
+}
+
+void KBDSENSE_Write(uint8_t value)
+{
+    hw.sense.written = value;
+}
+
+void KBDSENSE_SetDriveMode(uint8_t mode)
+{
+    uint8_t level = read_pins(&hw.sense, sense_keys());
+    hw.sense.strong = (mode == KBDSENSE_DM_STRONG);
+    float_pins(&hw.sense, level, sense_fall_cycles());
+}
+
+uint8_t MODIFIERS_Read(void)
+{
+    spend(READ_CYCLES);
+    return read_pins(&hw.modifiers, modifier_keys());
+}
+
+void MODIFIERS_Write(uint8_t value)
+{
+    hw.modifiers.written = value;
+}
+
+void MODIFIERS_SetDriveMode(uint8_t mode)
+{
+    uint8_t level = read_pins(&hw.modifiers, modifier_keys());
+    hw.modifiers.strong = (mode == MODIFIERS_DM_STRONG);
+    float_pins(&hw.modifiers, level, MODIFIERS_FALL_US * SIM_CYCLES_PER_US);
+}
+
+/* The LCD, an HD44780 with its R/W line tied low. Only the commands the
+ * firmware uses are understood. */
+
+void LCDDATA_Write(uint8_t value)
+{
+    hw.lcd_data = value;
+}
+
+static void lcd_latch(void)
+{
+    if (hw.lcd_rw || (hw.cycles < hw.lcd_ready)
+            || ((hw.cycles - hw.lcd_e_cycles) < LCD_PULSE_CYCLES))
+    {
+        hw.lcd_errors++;
+        return;
+    }
+
+    uint8_t b = hw.lcd_data;
+    uint32_t busy_us = LCD_FAST_US;
+    if (hw.lcd_rs)
+    {
+        hw.ddram[hw.lcd_address] = b;
+        hw.lcd_address = (hw.lcd_address + 1) & 0x7f;
+    }
+    else if (b & 0x80) /* set DDRAM address */
+        hw.lcd_address = b & 0x7f;
+    else if (b == 0x01) /* clear */
+    {
+        memset(hw.ddram, ' ', sizeof(hw.ddram));
+        hw.lcd_address = 0;
+        busy_us = LCD_SLOW_US;
+    }
+    else if (b == 0x02) /* home */
+    {
+        hw.lcd_address = 0;
+        busy_us = LCD_SLOW_US;
+    }
+    hw.lcd_ready = hw.cycles + (busy_us * SIM_CYCLES_PER_US);
+}
+
+static bool* lcd_pin(int pin)
+{
+    switch (pin)
+    {
+        case LCDCTRL_E: return &hw.lcd_e;
+        case LCDCTRL_RS: return &hw.lcd_rs;
+        default: return &hw.lcd_rw;
+    }
+}
+
+void CyPins_SetPin(int pin)
+{
+    if ((pin == LCDCTRL_E) && !hw.lcd_e)
+        hw.lcd_e_cycles = hw.cycles;
+    *lcd_pin(pin) = true;
+}
+
+void CyPins_ClearPin(int pin)
+{
+    if ((pin == LCDCTRL_E) && hw.lcd_e)
+    {
+        hw.lcd_e = false;
+        lcd_latch();
+    }
+    *lcd_pin(pin) = false;
+}
+
+/* USB. */
+
+void USBFS_Start(uint8_t device, uint8_t mode)
+{
+    hw.configure_cycles = hw.cycles + ((uint64_t) SIM_ENUMERATE_MS * SIM_CYCLES_PER_MS);
+}
+
+uint8_t USBFS_GetConfiguration(void)
+{
+    return hw.configured;
+}
+
+uint8_t USBFS_IsConfigurationChanged(void)
+{
+    bool changed = hw.config_changed;
+    hw.config_changed = false;
+    return changed;
+}
+
+void USBFS_EnableOutEP(uint8_t ep) {}
+
+void USBFS_LoadInEP(uint8_t ep, const uint8_t* data, uint16_t length)
+{
+    hw.ep_acked = false;
+    if (hw.load)
+        hw.load(hw.cycles, data, length);
+}
+
+uint8_t USBFS_GetEPAckState(uint8_t ep)
+{
+    return hw.ep_acked;
+}
+
+/* The host stays with the report protocol, which is what every HID device
+ * starts in; only a BIOS asks for the boot protocol. */
+
+uint8_t USBFS_GetProtocol(uint8_t interface)
+{
+    return USBFS_PROTOCOL_REPORT;
+}
+
+uint8_t USBFS_CheckActivity(void) { return true; }
+void USBFS_Suspend(void) {}
+void USBFS_Resume(void) {}
+uint8_t USBFS_RWUEnabled(void) { return false; }
+void USBFS_Force(uint8_t state) {}
+
+uint8_t USBFS_CDC_Init(void)
+{
+    return 0;
+}
+
+uint8_t USBFS_CDCIsReady(void)
+{
+    spend(READ_CYCLES);
+    return !hw.cdc_in_length;
+}
+
+void USBFS_PutData(const uint8_t* data, uint16_t length)
+{
+    memcpy(hw.cdc_in, data, length);
+    hw.cdc_in_length = length;
+}
+
+uint8_t USBFS_DataIsReady(void)
+{
+    return hw.cdc_out_length != 0;
+}
+
+uint16_t USBFS_GetCount(void)
+{
+    return hw.cdc_out_length;
+}
+
+uint16_t USBFS_GetData(uint8_t* data, uint16_t length)
+{
+    if (length > hw.cdc_out_length)
+        length = hw.cdc_out_length;
+    memcpy(data, hw.cdc_out, length);
+    hw.cdc_out_length = 0;
+    return length;
+}
+
+static bool ring_put(struct ring* r, char c)
+{
+    uint16_t next = (r->head + 1) % CDC_HOST_BUFFER;
+    if (next == r->tail)
+        return false;
+    r->data[r->head] = c;
+    r->head = next;
+    return true;
+}
+
+static bool ring_get(struct ring* r, char* c)
+{
+    if (r->head == r->tail)
+        return false;
+    *c = r->data[r->tail];
+    r->tail = (r->tail + 1) % CDC_HOST_BUFFER;
+    return true;
+}
+
+/* Once a frame the host configures the device, if it's time, and then
+ * SIM_POLL_US later takes anything waiting in the IN endpoints and sends a
+ * CDC packet if the last one has been read. */
+
+static void usb_sof(void)
+{
+    if (!hw.configured && (hw.cycles >= hw.configure_cycles))
+    {
+        hw.configured = true;
+        hw.config_changed = true;
+    }
+#if !USBFS_SOF_ISR_REMOVE
+    if (hw.configured)
+        USBFS_SOF_ISR_EntryCallback();
+#endif
+}
+
+static void usb_poll_endpoints(void)
+{
+    if (!hw.configured)
+        return;
+
+    if (!(hw.frame % hw.poll_ms) && !hw.ep_acked)
+    {
+        hw.ep_acked = true;
+        USBFS_EP_4_ISR_EntryCallback();
+    }
+
+    for (int i=0; i<hw.cdc_in_length; i++)
+        ring_put(&hw.from_device, hw.cdc_in[i]);
+    hw.cdc_in_length = 0;
+
+    if (!hw.cdc_out_length)
+    {
+        char c;
+        while ((hw.cdc_out_length < CDC_PACKET_SIZE) && ring_get(&hw.to_device, &c))
+            hw.cdc_out[hw.cdc_out_length++] = c;
+    }
+}
+
+static void usb_event(void)
+{
+    if (hw.usb_sof)
+    {
+        usb_sof();
+        hw.usb_due += SIM_POLL_US * SIM_CYCLES_PER_US;
+    }
+    else
+    {
+        usb_poll_endpoints();
+        hw.usb_due += SIM_CYCLES_PER_MS - (SIM_POLL_US * SIM_CYCLES_PER_US);
+        hw.frame++;
+    }
+    hw.usb_sof = !hw.usb_sof;
+}
+
+/* Keymap uploads aren't simulated, so the built-in keymap is always used. */
+
+bool mapstore_init(void)
+{
+    return false;
+}
+
+bool mapstore_begin(void)
+{
+    return false;
+}
+
+uint8_t mapstore_put(uint8_t byte)
+{
+    return MAPSTORE_FAILED;
+}
+
+/* The body of main()'s loop, without the suspend check (the simulated bus
+ * is never idle) and the keymap upload timeout; sim_run() does the
+ * sleeping. */
+
+static void main_loop(void)
+{
+    usb_poll();
+#if USBFS_SOF_ISR_REMOVE
+    report_poll();
+#endif
+    if (usb_ready)
+    {
+        CDC_Service();
+        CDC_Process();
+        selftest_poll(print_blocking);
+    }
+    SCR_Update();
+}
+
+void sim_init(uint8_t poll_ms, sim_load_t* load)
+{
+    hw.poll_ms = poll_ms;
+    hw.load = load;
+    hw.ep_acked = true;
+    hw.usb_sof = true;
+    hw.lcd_ready = (uint64_t) LCD_POWER_UP_MS * SIM_CYCLES_PER_MS;
+    memset(hw.ddram, ' ', sizeof(hw.ddram));
+    set_time(0);
+
+    /* As main(), up to its loop. */
+
+    perf_init();
+    USBFS_Start(0, USBFS_DWR_POWER_OPERATION);
+    combo_init(combos, NUM_COMBOS, post_keyevent);
+    if (!mapstore_init())
+        keymap_init(&base_layer, overlays, NUM_OVERLAYS, tapholds, NUM_TAPHOLDS);
+    Scanner_Start();
+    Tick_Start();
+    LCD_Init();
+    main_loop();
+}
+
+void sim_run(uint32_t us)
+{
+    uint64_t end = hw.cycles + ((uint64_t) us * SIM_CYCLES_PER_US);
+    while (next_interrupt() < end)
+    {
+        sim_wait_for_interrupt();
+        main_loop();
+    }
+    if (hw.cycles < end)
+        set_time(end);
+}
+
+uint64_t sim_cycles(void)
+{
+    return hw.cycles;
+}
+
+bool sim_idle(void)
+{
+    return idle;
+}
+
+uint8_t sim_plain_key(uint8_t position)
+{
+    uint8_t row = position >> 3;
+    uint8_t column = position & 7;
+    uint8_t keycode = base_layer[row][column];
+    if ((combo_used(row) & (1 << column)) || (keycode >= KEY_Trans))
+        return 0;
+    return keycode;
+}
+
+void sim_cdc_write(const char* data, uint16_t length)
+{
+    while (length--)
+        ring_put(&hw.to_device, *data++);
+}
+
+uint16_t sim_cdc_read(char* buffer, uint16_t size)
+{
+    uint16_t count = 0;
+    while ((count < size) && ring_get(&hw.from_device, &buffer[count]))
+        count++;
+    return count;
+}
+
+/* The cells are at the addresses SCR_Update() puts them. */
+
+void sim_lcd_text(char text[16])
+{
+    for (int i=0; i<15; i++)
+        text[i] = hw.ddram[(i < 7) ? (0x01 + i) : (0x3f - 7 + i)];
+    text[15] = '\0';
+}
+
+uint32_t sim_lcd_errors(void)
+{
+    return hw.lcd_errors;
+}
@@ -0,0 +1,78 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ *
+ * A simulated typestar4-keyboard: main.c, built as it is against the
+ * project.h in this directory, with the hardware it talks to simulated
+ * here.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+/* Time is kept in CPU cycles, as the firmware sees them through the cycle
+ * counter, and moves on as the firmware would see it: SysTick fires at the
+ * intervals the firmware loads into it, a USB frame starts every
+ * millisecond, and busy waits and pin reads take time. Interrupts are taken
+ * whenever the firmware waits for something, never nested; the main loop
+ * runs after each one. Every frame starts with a SOF (delivered to the
+ * firmware if it was built with the SOF interrupt), and SIM_POLL_US later
+ * the host polls the keyboard endpoint, if this is one of its polls, and
+ * the CDC endpoints. */
+
+#define SIM_ROWS 9
+#define SIM_POLL_US 100
+#define SIM_ENUMERATE_MS 400
+#define SIM_CYCLES_PER_US (BCLK__BUS_CLK__HZ / 1000000)
+#define SIM_CYCLES_PER_MS (BCLK__BUS_CLK__HZ / 1000)
+
+/* Which keys are physically down, a byte per row with a set bit meaning
+ * pressed, laid out like the keymap (so the last row is the modifiers).
+ * A sense line takes a row-dependent few microseconds to fall once nothing
+ * drives it, so a row read too soon after the one before it still sees that
+ * row's keys. */
+
+extern uint8_t sim_matrix[SIM_ROWS];
+
+/* Called whenever the firmware loads a report into the endpoint. */
+
+typedef void sim_load_t(uint64_t cycles, const uint8_t* data, uint8_t length);
+
+/* Starts the firmware, as main() does; the host configures it
+ * SIM_ENUMERATE_MS later. The host polls the keyboard endpoint every
+ * poll_ms milliseconds (its bInterval). This can only be done once. */
+
+extern void sim_init(uint8_t poll_ms, sim_load_t* load);
+
+/* Runs the firmware for us microseconds. */
+
+extern void sim_run(uint32_t us);
+
+extern uint64_t sim_cycles(void);
+
+/* Whether the firmware has idled the scanner, which it does after a couple
+ * of seconds with nothing held down. */
+
+extern bool sim_idle(void);
+
+/* Returns the keycode the built-in keymap gives the key at position if
+ * it's an ordinary key, sent as soon as it's pressed, or 0 if it does
+ * nothing, is a tap-hold or layer key, or is in a combo. */
+
+extern uint8_t sim_plain_key(uint8_t position);
+
+/* The host's side of the CDC serial port: sim_cdc_write() queues bytes to
+ * go to the keyboard, a packet per frame as it takes them, and
+ * sim_cdc_read() takes up to size bytes of what the keyboard has sent,
+ * returning how many there were. */
+
+extern void sim_cdc_write(const char* data, uint16_t length);
+extern uint16_t sim_cdc_read(char* buffer, uint16_t size);
+
+/* What the LCD is showing in each of the firmware's 15 screen cells, as a
+ * string, and the number of bytes sent to it while it was still busy with
+ * the one before (which a real HD44780 would ignore). */
+
+extern void sim_lcd_text(char text[16]);
+extern uint32_t sim_lcd_errors(void);
+
+#endif
@@ -0,0 +1,503 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ *
+ * Runs the simulated typestar4 (see sim.h) through everything it does,
+ * checking what the host and the LCD see:
+ *
+ *   - startup: the LCD says it's waiting for USB until the host configures
+ *     the keyboard, and then that it's ready, and the scan timings (from
+ *     ESC t) show the settle times were calibrated;
+ *
+ *   - latency: every ordinary key is pressed at ten points across a
+ *     millisecond, and so all through the scan pass, and must reach the
+ *     host with no other key; the time from the key going down to the
+ *     first report carrying it being loaded into the endpoint is collected
+ *     into a histogram; and the same again for one key pressed after the
+ *     scanner has idled;
+ *
+ *   - inject: text sent after ESC k, more than the injection queue and the
+ *     CDC receive ring hold, must be typed exactly, while a key held down on
+ *     the keyboard stays down throughout;
+ *
+ *   - screen: a burst of text sent to the screen must end up on the LCD;
+ *
+ *   - counters: the performance counters (ESC c) must arrive whole.
+ *
+ * All the while, nothing may be sent to the LCD while it's busy, and
+ * nothing may be dropped from the key event or LCD queues.
+ *
+ * Everything is deterministic. It exits with an error if anything is wrong.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "project.h"
+#include "usbkeycodes.h"
+#include "keymap.h"
+#include "report.h"
+#include "perf.h"
+#include "inject.h"
+#include "sim.h"
+
+#define BUCKET_US 250
+#define BUCKETS 16
+#define PHASES 10
+#define SEEN_TIMEOUT_MS 200
+#define HOLD_MS 30
+#define SETTLE_MS 100
+#define IDLE_TIMEOUT_MS 5000
+#define REPLY_MS 200
+#define TYPING_TIMEOUT_MS 5000
+#define TEXT_REPEATS 5
+
+#define SHIFTS ((1 << (KEY_LeftShift - KEY_LeftControl)) | (1 << (KEY_RightShift - KEY_LeftControl)))
+
+struct key
+{
+    uint8_t position;
+    uint8_t keycode;
+};
+
+/* What the host has been sent, and what it's waiting to see. */
+
+struct host_key
+{
+    bool pressed;
+    bool waiting;
+    uint64_t pressed_cycles;
+};
+
+/* Either kind of report, as the host reads it: the keys down, in the order
+ * it takes new ones to have been typed. */
+
+struct host_report
+{
+    bool rollover;
+    uint8_t modifiers;
+    uint8_t keys[REPORT_USAGES];
+    int count;
+};
+
+static struct key keys[KEYMAP_POSITIONS];
+static int num_keys;
+static struct host_key host[256];
+static struct host_report last_report;
+static char typed_chars[256];
+
+static bool typing;
+static uint8_t typing_held;
+static char typed[1024];
+static int typed_length;
+static uint32_t typing_held_lost;
+
+static uint32_t latency_buckets[BUCKETS];
+static uint64_t latency_min = UINT64_MAX;
+static uint64_t latency_max;
+static uint64_t latency_total;
+static uint32_t latency_count;
+static uint32_t lost;
+static uint32_t ghosts;
+static int failures;
+
+static bool is_modifier(uint8_t keycode)
+{
+    return (keycode >= KEY_LeftControl) && (keycode <= KEY_RightGUI);
+}
+
+static bool in_report(const struct host_report* r, uint8_t keycode)
+{
+    if (is_modifier(keycode))
+        return r->modifiers & (1 << (keycode - KEY_LeftControl));
+    for (int i=0; i<r->count; i++)
+        if (r->keys[i] == keycode)
+            return true;
+    return false;
+}
+
+static void decode_report(struct host_report* r, const uint8_t* data, uint8_t length)
+{
+    memset(r, 0, sizeof(*r));
+    r->modifiers = data[0];
+    if (length == sizeof(struct nkro_report))
+    {
+        const struct nkro_report* nkro = (const struct nkro_report*) data;
+        for (int keycode=0; keycode<REPORT_USAGES; keycode++)
+            if (nkro->bitmap[keycode >> 3] & (1 << (keycode & 7)))
+                r->keys[r->count++] = keycode;
+        return;
+    }
+
+    const struct boot_report* boot = (const struct boot_report*) data;
+    r->rollover = (boot->keys[0] == KEY_ErrorRollOver);
+    for (int i=0; (i<6) && !r->rollover; i++)
+        if (boot->keys[i])
+            r->keys[r->count++] = boot->keys[i];
+}
+
+static void record_latency(uint64_t cycles)
+{
+    uint32_t bucket = cycles / (BUCKET_US * SIM_CYCLES_PER_US);
+    if (bucket >= BUCKETS)
+        bucket = BUCKETS - 1;
+    latency_buckets[bucket]++;
+    if (cycles < latency_min)
+        latency_min = cycles;
+    if (cycles > latency_max)
+        latency_max = cycles;
+    latency_total += cycles;
+    latency_count++;
+}
+
+/* While typing, keys new in a report are typed, in order, shifted if the
+ * report has shift down. Otherwise every key in a report has to be one
+ * pressed on the keyboard. A rollover report means the host keeps the keys
+ * it had. */
+
+static void report_loaded(uint64_t cycles, const uint8_t* data, uint8_t length)
+{
+    struct host_report r;
+    decode_report(&r, data, length);
+    if (r.rollover)
+    {
+        ghosts++;
+        return;
+    }
+
+    if (typing)
+    {
+        for (int i=0; i<r.count; i++)
+        {
+            uint8_t keycode = r.keys[i];
+            if (in_report(&last_report, keycode) || (typed_length == (int) (sizeof(typed) - 1)))
+                continue;
+            uint8_t keystroke = keycode | ((r.modifiers & SHIFTS) ? INJECT_SHIFT : 0);
+            typed[typed_length++] = typed_chars[keystroke] ? typed_chars[keystroke] : '?';
+        }
+        if (!in_report(&r, typing_held))
+            typing_held_lost++;
+    }
+    else
+    {
+        for (int i=0; i<r.count; i++)
+            if (!host[r.keys[i]].pressed)
+                ghosts++;
+        for (int i=0; i<8; i++)
+            if ((r.modifiers & (1 << i)) && !host[KEY_LeftControl + i].pressed)
+                ghosts++;
+    }
+
+    for (int i=0; i<num_keys; i++)
+    {
+        struct host_key* k = &host[keys[i].keycode];
+        if (k->waiting && in_report(&r, keys[i].keycode))
+        {
+            record_latency(cycles - k->pressed_cycles);
+            k->waiting = false;
+        }
+    }
+    last_report = r;
+}
+
+static void press(const struct key* key, bool down)
+{
+    uint8_t row = key->position >> 3;
+    uint8_t bit = 1 << (key->position & 7);
+    if (down)
+    {
+        struct host_key* k = &host[key->keycode];
+        if (k->waiting)
+            lost++;
+        k->pressed = true;
+        k->waiting = true;
+        k->pressed_cycles = sim_cycles();
+        sim_matrix[row] |= bit;
+    }
+    else
+        sim_matrix[row] &= ~bit;
+}
+
+static void run(int ms)
+{
+    sim_run(ms * 1000);
+}
+
+/* Lets everything go and waits for the host to catch up; anything it still
+ * hasn't seen by then has been lost. */
+
+static void settle(void)
+{
+    memset(sim_matrix, 0, sizeof(sim_matrix));
+    run(SETTLE_MS);
+    for (int i=0; i<num_keys; i++)
+    {
+        struct host_key* k = &host[keys[i].keycode];
+        if (k->waiting)
+            lost++;
+        k->waiting = false;
+        k->pressed = false;
+    }
+}
+
+static void find_keys(void)
+{
+    for (int i=0; i<KEYMAP_POSITIONS; i++)
+    {
+        uint8_t keycode = sim_plain_key(i);
+        if (!keycode)
+            continue;
+
+        keys[num_keys].position = i;
+        keys[num_keys].keycode = keycode;
+        num_keys++;
+    }
+
+    for (int c=1; c<128; c++)
+    {
+        uint8_t keystroke = inject_translate(c);
+        if (keystroke && !typed_chars[keystroke])
+            typed_chars[keystroke] = c;
+    }
+}
+
+static void fail(const char* what)
+{
+    printf("  %s: FAILED\n", what);
+    failures++;
+}
+
+static void expect_lcd(const char* what, const char* expected)
+{
+    char text[16];
+    char padded[16];
+    sim_lcd_text(text);
+    snprintf(padded, sizeof(padded), "%-15s", expected);
+    printf("  %s, lcd shows \"%s\"\n", what, text);
+    if (strcmp(text, padded))
+        fail("lcd");
+}
+
+/* Sends a command over CDC, and collects what comes back in the next
+ * REPLY_MS. */
+
+static uint16_t command(const char* c, char* reply, uint16_t size)
+{
+    uint16_t length = 0;
+    sim_cdc_write(c, strlen(c));
+    for (int t=0; t<REPLY_MS; t++)
+    {
+        run(1);
+        length += sim_cdc_read(reply + length, size - 1 - length);
+    }
+    reply[length] = '\0';
+    return length;
+}
+
+static void startup(void)
+{
+    char reply[256];
+
+    printf("startup:\n");
+    run(SIM_ENUMERATE_MS - 50);
+    expect_lcd("before USB", "Waiting for USB");
+    if (perf.first_report_ms)
+        fail("reports before USB");
+    run(200);
+    expect_lcd("after USB", "Ready");
+
+    command("\x1bt", reply, sizeof(reply));
+    printf("  %s", reply);
+    if (strncmp(reply, "settle (calibrated)", 19))
+        fail("calibration");
+}
+
+/* Presses the key phase tenths of the way through a millisecond, and waits
+ * for the host to see it. */
+
+static void press_at(const struct key* key, int phase)
+{
+    run(1);
+    sim_run(1000 - ((sim_cycles() / SIM_CYCLES_PER_US) % 1000) + (phase * 1000 / PHASES));
+
+    press(key, true);
+    for (int t=0; host[key->keycode].waiting && (t<SEEN_TIMEOUT_MS); t++)
+        run(1);
+    run(HOLD_MS);
+    press(key, false);
+    run(SETTLE_MS);
+    host[key->keycode].pressed = false;
+}
+
+static void print_latency(const char* title)
+{
+    if (latency_count)
+        printf("%s, key down to report loaded: n=%lu min=%luus avg=%luus max=%luus\n",
+            title, (unsigned long) latency_count,
+            (unsigned long) (latency_min / SIM_CYCLES_PER_US),
+            (unsigned long) (latency_total / latency_count / SIM_CYCLES_PER_US),
+            (unsigned long) (latency_max / SIM_CYCLES_PER_US));
+    else
+        printf("%s: no presses seen\n", title);
+    for (int i=0; i<BUCKETS; i++)
+    {
+        if (!latency_buckets[i])
+            continue;
+        if (i == (BUCKETS-1))
+            printf("  >=%dus: %lu\n", i*BUCKET_US, (unsigned long) latency_buckets[i]);
+        else
+            printf("  %d-%dus: %lu\n", i*BUCKET_US, (i+1)*BUCKET_US,
+                (unsigned long) latency_buckets[i]);
+    }
+    if (lost)
+    {
+        printf("  %lu presses lost\n", (unsigned long) lost);
+        failures++;
+    }
+    if (ghosts)
+    {
+        printf("  %lu reports with keys which weren't pressed\n", (unsigned long) ghosts);
+        failures++;
+    }
+
+    memset(latency_buckets, 0, sizeof(latency_buckets));
+    latency_min = UINT64_MAX;
+    latency_max = latency_total = latency_count = 0;
+    lost = ghosts = 0;
+}
+
+static void latency(void)
+{
+    for (int i=0; i<num_keys; i++)
+        for (int phase=0; phase<PHASES; phase++)
+            press_at(&keys[i], phase);
+    settle();
+    print_latency("latency");
+}
+
+static void wake(void)
+{
+    for (int phase=0; phase<PHASES; phase++)
+    {
+        for (int t=0; !sim_idle() && (t<IDLE_TIMEOUT_MS); t++)
+            run(1);
+        if (!sim_idle())
+        {
+            printf("latency from idle: the scanner never idled\n");
+            failures++;
+            return;
+        }
+        press_at(&keys[0], phase);
+    }
+    settle();
+    print_latency("latency from idle");
+}
+
+/* The text avoids the held key, as that would wait for it to be let go. */
+
+static void inject(void)
+{
+    static const char line[] = "Hello, World! 0123456789 ~!@#$%^&*()_+ {}|:\"<>? `-=[]\\;',./\n";
+    char text[sizeof(line) * TEXT_REPEATS];
+    char message[sizeof(text) + 3];
+
+    text[0] = '\0';
+    for (int i=0; i<TEXT_REPEATS; i++)
+        strcat(text, line);
+    snprintf(message, sizeof(message), "\x1bk%s\x1b", text);
+
+    const struct key* held = &keys[0];
+    press(held, true);
+    run(SETTLE_MS);
+
+    typing = true;
+    typing_held = held->keycode;
+    uint64_t start = sim_cycles();
+    sim_cdc_write(message, strlen(message));
+    for (int t=0; (typed_length < (int) strlen(text)) && (t<TYPING_TIMEOUT_MS); t++)
+        run(1);
+    uint64_t elapsed = sim_cycles() - start;
+    run(SETTLE_MS);
+    typing = false;
+    settle();
+
+    printf("inject: %d characters in %lums, held key lost from %lu reports\n",
+        typed_length, (unsigned long) (elapsed / SIM_CYCLES_PER_MS),
+        (unsigned long) typing_held_lost);
+    if (strcmp(typed, text))
+        fail("typed text");
+    if (typing_held_lost)
+        fail("held key");
+}
+
+static void screen(void)
+{
+    char text[256];
+
+    printf("screen:\n");
+    text[0] = '\n';
+    for (int i=1; i<200; i++)
+        text[i] = 'a' + (i % 26);
+    strcpy(&text[200], "\nthe end");
+    sim_cdc_write(text, strlen(text));
+    run(REPLY_MS);
+    expect_lcd("after a burst", "the end");
+}
+
+static void counters(void)
+{
+    char reply[2048];
+
+    printf("counters:\n");
+    uint16_t length = command("\x1b" "c", reply, sizeof(reply));
+    bool whole = !strncmp(reply, "isr: ", 5) && (length > 40) && strstr(reply + length - 40, "cdc: ");
+    for (char* line = strtok(reply, "\r\n"); line; line = strtok(NULL, "\r\n"))
+        printf("  %s\n", line);
+    if (!whole)
+        fail("counters");
+
+    if (perf.events_dropped || perf.lcd_dropped)
+        fail("queues");
+    if (sim_lcd_errors())
+        fail("lcd timing");
+}
+
+int main(int argc, char* argv[])
+{
+    int poll_ms = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                poll_ms = atoi(optarg);
+                if ((poll_ms >= 1) && (poll_ms <= 255))
+                    break;
+                /* fall through */
+            default:
+                fprintf(stderr, "usage: simtest [-p poll_ms]\n");
+                exit(1);
+        }
+    }
+
+    sim_init(poll_ms, report_loaded);
+    find_keys();
+    printf("simtest: typestar4, %d keys, host polls every %dms, %s reports, %s\n",
+        num_keys, poll_ms, REPORT_NKRO ? "NKRO" : "boot",
+        USBFS_SOF_ISR_REMOVE ? "sent from the main loop" : "sent on SOF");
+
+    startup();
+    latency();
+    wake();
+    inject();
+    screen();
+    counters();
+
+    if (failures)
+    {
+        printf("simtest: failed\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,454 @@
+#!/usr/bin/env python3
+# maxii-keyboard / typestar4-keyboard keymap compiler
+# (C) 2017 David Given
+
+"""Compiles a keyboard layout into the keymap tables used by the firmware.
+
+Two files go in. The wiring file says where each key is in the keymap, by
+name; it's different for each board and shouldn't need to change. Each
+line holds any number of entries like
+
+    Escape=4.4
+
+meaning the key called Escape is at row 4, column 4 (for a matrix row,
+that's the probe line and the sense line). Key names are just names, but
+naming a key after its usual keycode saves typing in the layout.
+
+The layout file is a series of layers, the first one being the base layer:
+
+    layer Base
+        Escape 1 2 3 Enter2=Enter Magic=Escape/mo(Magic)
+    layer Magic transparent
+        1=F1 2=F2 Magic=TTT
+    combo J+K=Escape
+
+Each entry is key=action, or just key if the action is the keycode of the
+same name. An action is a keycode name from usbkeycodes.h (without the
+KEY_), ___ for nothing, TTT for the layer below, mo(layer) or tg(layer),
+or tap/hold for a tap-hold key. Layers after the first are stored sparsely,
+and keys they don't mention do nothing, or fall through to the layer below
+if the layer is transparent. A combo is a set of keys, joined by +, which
+acts as one extra key when pressed together.
+
+The output is a header of tables for main.c, and optionally a keymap image
+for uploading (see mapstore.h). Table sizes are reported as it goes; keys
+which are in the wiring but not mentioned by the base layer are warned
+about, and duplicate positions or keys are errors. Everything is checked
+here, so the firmware doesn't have to.
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+import zlib
+
+# These must match keymap.h, combo.h and mapstore.h.
+
+KEY_TRANS = 0xe8
+MAX_LAYERS = 8
+MAX_TAPHOLDS = 4
+MAX_COMBOS = 128
+MAX_COMBO_KEYS = 8
+MAPSTORE_BANK_SIZE = 1024
+MAPSTORE_VERSION = 1
+
+
+class CompileError(Exception):
+    pass
+
+
+def warn(where, message):
+    print("%s: warning: %s" % (where, message), file=sys.stderr)
+
+
+def pad4(n):
+    return (n + 3) & ~3
+
+
+class Action:
+    """A keymap entry, kept both as its value and as C source."""
+
+    def __init__(self, value, source):
+        self.value = value
+        self.source = source
+
+
+NOTHING = Action(0, "0")
+TRANS = Action(KEY_TRANS, "KEY_Trans")
+
+
+def read_lines(filename):
+    with open(filename) as f:
+        for number, line in enumerate(f, 1):
+            words = line.split("#", 1)[0].split()
+            if words:
+                yield ("%s:%d" % (filename, number), words)
+
+
+def read_keycodes(filename):
+    keycodes = {}
+    with open(filename) as f:
+        for m in re.finditer(r"\bKEY_(\w+)\s*=\s*(\d+)", f.read()):
+            keycodes[m.group(1)] = int(m.group(2))
+    return keycodes
+
+
+class Wiring:
+    def __init__(self, filename):
+        self.rows = None
+        self.keys = {}
+        self.names = {}
+
+        for where, words in read_lines(filename):
+            if words[0] == "rows":
+                self.rows = int(words[1])
+                continue
+
+            for word in words:
+                m = re.fullmatch(r"([^=]+)=(\d+)\.(\d+)", word)
+                if not m:
+                    raise CompileError("%s: can't parse '%s'" % (where, word))
+                name = m.group(1)
+                row = int(m.group(2))
+                column = int(m.group(3))
+                position = row*8 + column
+
+                if (column > 7) or (self.rows is None) or (row >= self.rows):
+                    raise CompileError("%s: %s is off the edge of the keymap" % (where, name))
+                if name in self.keys:
+                    raise CompileError("%s: duplicate key %s" % (where, name))
+                if position in self.names:
+                    raise CompileError("%s: %s is at the same position as %s"
+                        % (where, name, self.names[position]))
+                self.keys[name] = position
+                self.names[position] = name
+
+        if self.rows is None:
+            raise CompileError("%s: no 'rows' line" % filename)
+
+    @property
+    def positions(self):
+        return self.rows * 8
+
+    @property
+    def present_words(self):
+        return (self.rows + 3) // 4
+
+
+class Layer:
+    def __init__(self, name, index, transparent, where):
+        self.name = name
+        self.index = index
+        self.transparent = transparent
+        self.where = where
+        self.entries = {}
+
+
+class Layout:
+    def __init__(self, filename, wiring, keycodes):
+        self.wiring = wiring
+        self.keycodes = keycodes
+        self.layers = []
+        self.tapholds = []
+        self.combos = []
+
+        lines = list(read_lines(filename))
+
+        # Layers can be referred to before they're defined, so they're all
+        # found first.
+
+        layer_names = {}
+        for where, words in lines:
+            if words[0] == "layer":
+                if (len(words) < 2) or (len(words) > 3) \
+                        or ((len(words) == 3) and (words[2] != "transparent")):
+                    raise CompileError("%s: syntax: layer <name> [transparent]" % where)
+                if words[1] in layer_names:
+                    raise CompileError("%s: duplicate layer %s" % (where, words[1]))
+                layer_names[words[1]] = len(layer_names)
+        self.layer_names = layer_names
+        if len(layer_names) > MAX_LAYERS:
+            raise CompileError("%s: too many layers (the maximum is %d)" % (filename, MAX_LAYERS))
+
+        layer = None
+        for where, words in lines:
+            if words[0] == "layer":
+                layer = Layer(words[1], len(self.layers), len(words) == 3, where)
+                self.layers.append(layer)
+            elif words[0] == "combo":
+                for word in words[1:]:
+                    self.add_combo(where, word)
+            elif layer is None:
+                raise CompileError("%s: keys must come after a 'layer' line" % where)
+            else:
+                for word in words:
+                    self.add_entry(where, layer, word)
+
+        if not self.layers:
+            raise CompileError("%s: no layers" % filename)
+        if self.layers[0].transparent:
+            raise CompileError("%s: the base layer can't be transparent" % self.layers[0].where)
+
+        for name, position in sorted(wiring.keys.items(), key=lambda k: k[1]):
+            if position not in self.layers[0].entries:
+                warn(self.layers[0].where, "%s (%d.%d) isn't mapped"
+                    % (name, position // 8, position % 8))
+
+    def find_key(self, where, name):
+        if name not in self.wiring.keys:
+            raise CompileError("%s: no key called %s in the wiring" % (where, name))
+        return self.wiring.keys[name]
+
+    def add_entry(self, where, layer, word):
+        name, _, action = word.partition("=")
+        if not action:
+            action = name
+        position = self.find_key(where, name)
+        if position in layer.entries:
+            raise CompileError("%s: %s appears twice in layer %s" % (where, name, layer.name))
+        layer.entries[position] = self.parse_action(where, action, True)
+
+    def add_combo(self, where, word):
+        keys, _, action = word.partition("=")
+        keys = keys.split("+")
+        if not action or (len(keys) < 2):
+            raise CompileError("%s: syntax: combo <key>+<key>...=<keycode>" % where)
+        if len(keys) > MAX_COMBO_KEYS:
+            raise CompileError("%s: a combo can have at most %d keys" % (where, MAX_COMBO_KEYS))
+        positions = set()
+        for name in keys:
+            position = self.find_key(where, name)
+            if position in positions:
+                raise CompileError("%s: %s appears twice in this combo" % (where, name))
+            positions.add(position)
+        for other, _, _ in self.combos:
+            if other == positions:
+                raise CompileError("%s: duplicate combo %s" % (where, "+".join(keys)))
+        if len(self.combos) == MAX_COMBOS:
+            raise CompileError("%s: too many combos (the maximum is %d)" % (where, MAX_COMBOS))
+        self.combos.append((positions, self.parse_keycode(where, action), "+".join(keys)))
+
+    def parse_keycode(self, where, name):
+        if name not in self.keycodes:
+            raise CompileError("%s: no keycode called %s" % (where, name))
+        return Action(self.keycodes[name], "KEY_" + name)
+
+    def parse_layer(self, where, name):
+        if name not in self.layer_names:
+            raise CompileError("%s: no layer called %s" % (where, name))
+        return self.layer_names[name]
+
+    def parse_action(self, where, text, taphold_allowed):
+        if text == "___":
+            return NOTHING
+        if text == "TTT":
+            return TRANS
+
+        m = re.fullmatch(r"(mo|tg)\((\w+)\)", text)
+        if m:
+            n = self.parse_layer(where, m.group(2))
+            if m.group(1) == "mo":
+                return Action(0xf0 | n, "LAYER_MO(%d)" % n)
+            return Action(0xf8 | n, "LAYER_TG(%d)" % n)
+
+        if "/" in text:
+            if not taphold_allowed:
+                raise CompileError("%s: tap-hold keys can't be nested" % where)
+            tap, _, hold = text.partition("/")
+            pair = (self.parse_action(where, tap, False), self.parse_action(where, hold, False))
+            for a in pair:
+                if (a.value == KEY_TRANS) or (a.value >= 0xf8):
+                    raise CompileError("%s: a tap-hold key's actions must be keycodes or mo()" % where)
+
+            for n, (t, h) in enumerate(self.tapholds):
+                if (t.value, h.value) == (pair[0].value, pair[1].value):
+                    break
+            else:
+                n = len(self.tapholds)
+                if n == MAX_TAPHOLDS:
+                    raise CompileError("%s: too many tap-hold keys (the maximum is %d)" % (where, MAX_TAPHOLDS))
+                self.tapholds.append(pair)
+            return Action(0xec | n, "TAP_HOLD(%d)" % n)
+
+        return self.parse_keycode(where, text)
+
+    def present_bitmap(self, layer):
+        rows = [0] * (self.wiring.present_words * 4)
+        for position in layer.entries:
+            rows[position // 8] |= 1 << (position % 8)
+        return rows
+
+    def combo_bitmap(self, positions):
+        rows = [0] * (self.wiring.present_words * 4)
+        for position in positions:
+            rows[position // 8] |= 1 << (position % 8)
+        return rows
+
+
+def c_name(name):
+    return re.sub(r"\W", "_", name).lower()
+
+
+def c_bitmap(rows):
+    return ", ".join("0x%02x" % r for r in rows)
+
+
+def write_header(out, layout, sources):
+    wiring = layout.wiring
+    base = layout.layers[0]
+    overlays = layout.layers[1:]
+
+    out.write("/* Generated by tools/keymapc.py from %s.\n"
+        " * Don't edit this; edit those and rebuild. */\n\n" % " and ".join(sources))
+    out.write("#if KEYMAP_ROWS != %d\n" % wiring.rows)
+    out.write("#error \"the wiring doesn't match KEYMAP_ROWS\"\n")
+    out.write("#endif\n\n")
+
+    out.write("/* Layer 0, %s. */\n\n" % base.name)
+    out.write("static const keymap_layer_t base_layer = {\n")
+    for row in range(wiring.rows):
+        entries = [base.entries.get(row*8 + column, NOTHING).source for column in range(8)]
+        out.write("    { %s }%s\n" % (", ".join(entries), "," if (row < wiring.rows-1) else ""))
+    out.write("};\n\n")
+
+    for layer in overlays:
+        name = c_name(layer.name)
+        out.write("/* Layer %d, %s: %s, %d entries. */\n\n"
+            % (layer.index, layer.name, "transparent" if layer.transparent else "opaque",
+                len(layer.entries)))
+        out.write("static const uint8_t %s_actions[] = {\n" % name)
+        positions = sorted(layer.entries)
+        for row in range(wiring.rows):
+            entries = [layer.entries[p].source for p in positions if (p // 8) == row]
+            if entries:
+                out.write("    %s,\n" % ", ".join(entries))
+        if not positions:
+            out.write("    0\n")
+        out.write("};\n\n")
+        out.write("static const union keymap_present %s_present = {\n" % name)
+        out.write("    .rows = { %s }\n" % c_bitmap(layout.present_bitmap(layer)))
+        out.write("};\n\n")
+
+    out.write("#define NUM_OVERLAYS %d\n\n" % len(overlays))
+    out.write("static const struct keymap_overlay overlays[%d] = {\n" % max(len(overlays), 1))
+    for i, layer in enumerate(overlays):
+        name = c_name(layer.name)
+        out.write("    {\n")
+        out.write("        .present = &%s_present,\n" % name)
+        out.write("        .actions = %s_actions,\n" % name)
+        out.write("        .count = %d,\n" % len(layer.entries))
+        out.write("        .transparent = %s\n" % ("true" if layer.transparent else "false"))
+        out.write("    }%s\n" % ("," if (i < len(overlays)-1) else ""))
+    if not overlays:
+        out.write("    { 0 }\n")
+    out.write("};\n\n")
+
+    out.write("#define NUM_TAPHOLDS %d\n\n" % len(layout.tapholds))
+    out.write("static const struct keymap_taphold tapholds[%d] = {\n" % max(len(layout.tapholds), 1))
+    for i, (tap, hold) in enumerate(layout.tapholds):
+        out.write("    { %s, %s }%s\n" % (tap.source, hold.source,
+            "," if (i < len(layout.tapholds)-1) else ""))
+    if not layout.tapholds:
+        out.write("    { 0 }\n")
+    out.write("};\n\n")
+
+    out.write("#define NUM_COMBOS %d\n\n" % len(layout.combos))
+    out.write("static const struct combo combos[%d] = {\n" % max(len(layout.combos), 1))
+    for i, (positions, action, names) in enumerate(layout.combos):
+        out.write("    { .keys.rows = { %s }, .action = %s }%s /* %s */\n"
+            % (c_bitmap(layout.combo_bitmap(positions)), action.source,
+                "," if (i < len(layout.combos)-1) else "", names))
+    if not layout.combos:
+        out.write("    { .action = 0 }\n")
+    out.write("};\n")
+
+
+def build_image(layout):
+    wiring = layout.wiring
+    base = layout.layers[0]
+    overlays = layout.layers[1:]
+
+    def padded(data):
+        return data + bytes(pad4(len(data)) - len(data))
+
+    body = padded(bytes(base.entries.get(p, NOTHING).value for p in range(wiring.positions)))
+    for layer in overlays:
+        positions = sorted(layer.entries)
+        body += bytes(layout.present_bitmap(layer))
+        body += struct.pack("<BB2x", len(positions), layer.transparent)
+        body += padded(bytes(layer.entries[p].value for p in positions))
+    for tap, hold in layout.tapholds:
+        body += struct.pack("<BB", tap.value, hold.value)
+
+    tail = struct.pack("<BBBB", MAPSTORE_VERSION, wiring.rows, len(overlays),
+        len(layout.tapholds)) + body
+    length = 12 + len(tail)
+    if length > MAPSTORE_BANK_SIZE:
+        raise CompileError("the keymap image is %d bytes, which won't fit in a %d byte bank"
+            % (length, MAPSTORE_BANK_SIZE))
+    return b"KMAP" + struct.pack("<HHI", 0, length, zlib.crc32(tail)) + tail
+
+
+def report(layout):
+    wiring = layout.wiring
+    bitmap = wiring.present_words * 4
+    total = 0
+
+    def line(what, size):
+        nonlocal total
+        total += size
+        print("  %-32s %5d bytes" % (what, size))
+
+    base = layout.layers[0]
+    line("layer 0, %s (%d keys)" % (base.name, len(base.entries)), wiring.positions)
+    for layer in layout.layers[1:]:
+        line("layer %d, %s (%d entries)" % (layer.index, layer.name, len(layer.entries)),
+            bitmap + len(layer.entries))
+    line("tap-hold keys (%d)" % len(layout.tapholds), len(layout.tapholds) * 2)
+    line("combos (%d)" % len(layout.combos), len(layout.combos) * (bitmap + 4))
+    print("  %-32s %5d bytes" % ("total", total))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compiles a keyboard layout into keymap tables.")
+    parser.add_argument("wiring", help="the board's wiring description")
+    parser.add_argument("layout", help="the layout")
+    parser.add_argument("-o", "--output", help="the header to write")
+    parser.add_argument("-i", "--image", help="a keymap image to write, for uploading")
+    parser.add_argument("-k", "--keycodes",
+        help="usbkeycodes.h (default: the one next to the layout)")
+    args = parser.parse_args()
+
+    keycodes_file = args.keycodes or os.path.join(os.path.dirname(args.layout), "usbkeycodes.h")
+
+    try:
+        wiring = Wiring(args.wiring)
+        layout = Layout(args.layout, wiring, read_keycodes(keycodes_file))
+
+        print("%s:" % args.layout)
+        report(layout)
+
+        if args.output:
+            sources = [os.path.basename(args.layout), os.path.basename(args.wiring)]
+            with open(args.output, "w") as out:
+                write_header(out, layout, sources)
+
+        if args.image:
+            if layout.combos:
+                warn(args.layout, "combos aren't stored in keymap images")
+            image = build_image(layout)
+            with open(args.image, "wb") as out:
+                out.write(image)
+            print("  image: %d bytes" % len(image))
+    except CompileError as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)
+    except OSError as e:
+        print("error: %s" % e, file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
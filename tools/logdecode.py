@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+# maxii-keyboard event log decoder
+# (C) 2017 David Given
+
+"""Turns the maxii-keyboard's binary event log (see eventlog.h) into text.
+
+Feed it everything the UART sends, from a file or a serial port (set up
+with stty first), and press g on the keyboard's serial port to start the
+log:
+
+    python3 tools/logdecode.py /dev/ttyUSB0
+
+Records are picked out by their sync byte and checksum; anything else that
+comes down the line is printed as it is. Key positions are named from the
+board's wiring.txt, and keycodes from usbkeycodes.h.
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+from keymapc import CompileError, Wiring, read_keycodes
+
+SYNC = 0xa5
+RECORD = struct.Struct("<BBBBHH")
+KEYMAP_RELEASE = 0x100
+
+DROPPED, EVENT, OUTPUT, REPORT = range(4)
+
+MODIFIERS = ["LCtrl", "LShift", "LAlt", "LGUI", "RCtrl", "RShift", "RAlt", "RGUI"]
+
+
+class Decoder:
+    def __init__(self, names, keycodes):
+        self.names = names
+        self.keycodes = keycodes
+        self.last_time = None
+        self.last_c = None
+
+    def position(self, position):
+        if position in self.names:
+            return self.names[position]
+        return "%d.%d" % (position // 8, position % 8)
+
+    def keycode(self, keycode):
+        if keycode in self.keycodes:
+            return self.keycodes[keycode]
+        return "0x%02x" % keycode
+
+    def record(self, type, arg, value, time):
+        if self.last_time is None:
+            delta = 0
+        else:
+            delta = (time - self.last_time) & 0xffff
+        self.last_time = time
+        stamp = "%5d +%-5d" % (time, delta)
+
+        if type == DROPPED:
+            return "%s dropped %d records" % (stamp, value)
+        if type == EVENT:
+            return "%s event   %s %s" % (stamp, self.position(arg),
+                "pressed" if value else "released")
+        if type == OUTPUT:
+            return "%s output  %s %s" % (stamp, self.keycode(value & 0xff),
+                "up" if (value & KEYMAP_RELEASE) else "down")
+        if type == REPORT:
+            modifiers = [m for i, m in enumerate(MODIFIERS) if arg & (1 << i)]
+            return "%s report  %d bytes %s" % (stamp, value, "+".join(modifiers) or "-")
+        return "%s unknown record type %d (%d, %d)" % (stamp, type, arg, value)
+
+    def decode(self, data, write):
+        """Decodes as much of data as possible, returning what's left over."""
+
+        i = 0
+        text = bytearray()
+        while i < len(data):
+            if data[i] == SYNC:
+                if (len(data) - i) < RECORD.size:
+                    break
+                chunk = data[i:i+RECORD.size]
+                if (sum(chunk) & 0xff) == 0:
+                    if text:
+                        write(text.decode("ascii", "replace"))
+                        text = bytearray()
+                    _, type, arg, _, value, time = RECORD.unpack(chunk)
+                    write(self.record(type, arg, value, time) + "\n")
+                    i += RECORD.size
+                    continue
+
+            # The firmware ends lines with CR, or sometimes CR LF.
+
+            c = data[i]
+            if c == 0x0d:
+                text.extend(b"\n")
+            elif c == 0x0a:
+                if self.last_c != 0x0d:
+                    text.extend(b"\n")
+            elif 0x20 <= c < 0x7f:
+                text.append(c)
+            self.last_c = c
+            i += 1
+
+        if text:
+            write(text.decode("ascii", "replace"))
+        return data[i:]
+
+
+def main():
+    board = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "maxii-keyboard.cydsn")
+    parser = argparse.ArgumentParser(description="Decodes the maxii-keyboard event log.")
+    parser.add_argument("input", nargs="?", help="file or serial port to read (default: stdin)")
+    parser.add_argument("-w", "--wiring", default=os.path.join(board, "wiring.txt"),
+        help="wiring.txt, for naming key positions")
+    parser.add_argument("-k", "--keycodes", default=os.path.join(board, "usbkeycodes.h"),
+        help="usbkeycodes.h, for naming keycodes")
+    args = parser.parse_args()
+
+    try:
+        names = Wiring(args.wiring).names
+        keycodes = {v: k for k, v in read_keycodes(args.keycodes).items()}
+    except (CompileError, OSError) as e:
+        print("warning: %s; positions and keycodes will be numbers" % e, file=sys.stderr)
+        names = {}
+        keycodes = {}
+
+    decoder = Decoder(names, keycodes)
+    f = open(args.input, "rb", buffering=0) if args.input else sys.stdin.buffer
+    pending = b""
+
+    def write(s):
+        sys.stdout.write(s)
+        sys.stdout.flush()
+
+    try:
+        while True:
+            data = f.read(256)
+            if not data:
+                break
+            pending = decoder.decode(pending + data, write)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+# maxii-keyboard scan trace writer
+# (C) 2017 David Given
+
+"""Writes a scan trace (see trace.h) from a script of key presses, for
+feeding to test/replay.
+
+Each line of the script is
+
+    frames key down|up
+
+meaning that the key, named as in the board's wiring.txt, goes down or up
+that many frames (scan passes) after the line before it; 0 means in the
+same frame. Anything after a # is a comment. For example, a quick J:
+
+    1 J down
+    4 J up
+
+Changes in the same row in the same frame are merged into one entry, as the
+scanner would record them.
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+from keymapc import CompileError, Wiring, read_lines
+
+HEADER = struct.Struct("<4sBBH")
+ENTRY = struct.Struct("<HBB")
+TRACE_VERSION = 1
+TRACE_ENTRIES = 512
+TRACE_ROW_TIME = 0xff
+MAX_DELTA = 0xffff
+
+
+def read_script(filename, wiring):
+    """Returns the frames the keys change in, as (frame, {row: sense})."""
+
+    frames = []
+    state = [0] * wiring.rows
+    frame = 0
+    for where, words in read_lines(filename):
+        if (len(words) != 3) or (words[2] not in ("down", "up")):
+            raise CompileError("%s: expected 'frames key down|up'" % where)
+        try:
+            frame += int(words[0])
+        except ValueError:
+            raise CompileError("%s: '%s' isn't a number of frames" % (where, words[0]))
+        if words[1] not in wiring.keys:
+            raise CompileError("%s: no key called %s" % (where, words[1]))
+
+        position = wiring.keys[words[1]]
+        row = position // 8
+        bit = 1 << (position % 8)
+        if words[2] == "down":
+            state[row] |= bit
+        else:
+            state[row] &= ~bit
+
+        if not frames or (frames[-1][0] != frame):
+            frames.append((frame, {}))
+        frames[-1][1][row] = state[row]
+    return frames
+
+
+def build_trace(frames, rows):
+    entries = []
+    state = [0] * rows
+    last = 0
+    for frame, changes in frames:
+        for row in sorted(changes):
+            if changes[row] == state[row]:
+                continue
+            state[row] = changes[row]
+
+            delta = frame - last
+            last = frame
+            while delta > MAX_DELTA:
+                entries.append(ENTRY.pack(MAX_DELTA, TRACE_ROW_TIME, 0))
+                delta -= MAX_DELTA
+            entries.append(ENTRY.pack(delta, row, changes[row]))
+
+    if len(entries) > TRACE_ENTRIES:
+        raise CompileError("%d entries is more than the keyboard's trace holds (%d)"
+            % (len(entries), TRACE_ENTRIES))
+    return HEADER.pack(b"KTRC", TRACE_VERSION, rows, len(entries)) + b"".join(entries)
+
+
+def main():
+    board = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "maxii-keyboard.cydsn")
+    parser = argparse.ArgumentParser(description="Writes a scan trace from a script of key presses.")
+    parser.add_argument("script", help="the script")
+    parser.add_argument("-o", "--output", required=True, help="the trace to write")
+    parser.add_argument("-w", "--wiring", default=os.path.join(board, "wiring.txt"),
+        help="wiring.txt, for the key names")
+    args = parser.parse_args()
+
+    try:
+        wiring = Wiring(args.wiring)
+        trace = build_trace(read_script(args.script, wiring), wiring.rows)
+        with open(args.output, "wb") as out:
+            out.write(trace)
+    except CompileError as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)
+    except OSError as e:
+        print("error: %s" % e, file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
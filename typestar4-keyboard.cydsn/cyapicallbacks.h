@@ -0,0 +1,24 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef CYAPICALLBACKS_H
+#define CYAPICALLBACKS_H
+
+/* Sets a flag for the main loop when the host resumes a suspended bus. */
+
+#define USBFS_DP_ISR_ENTRY_CALLBACK
+extern void USBFS_DP_ISR_EntryCallback(void);
+
+/* Stages and sends keyboard reports once per USB frame, and keeps the scan
+ * tick in step with it. */
+
+#define USBFS_SOF_ISR_ENTRY_CALLBACK
+extern void USBFS_SOF_ISR_EntryCallback(void);
+
+/* Times the host's ACK of each report, for the latency self-test. */
+
+#define USBFS_EP_4_ISR_ENTRY_CALLBACK
+extern void USBFS_EP_4_ISR_EntryCallback(void);
+
+#endif
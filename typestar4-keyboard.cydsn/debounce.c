@@ -0,0 +1,53 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stdint.h>
+#include "debounce.h"
+
+void debounce_init(struct debounce_row* row, const uint8_t* config)
+{
+    row->state = row->c0 = row->c1 = row->c2 = 0;
+    row->t0 = row->t1 = row->t2 = row->eager = 0;
+
+    for (int y=0; y<8; y++)
+    {
+        uint8_t bit = 1<<y;
+        uint8_t samples = config[y] & DEBOUNCE_SAMPLES_MASK;
+        if (samples == 0)
+            samples = 1;
+
+        if (samples & 1)
+            row->t0 |= bit;
+        if (samples & 2)
+            row->t1 |= bit;
+        if (samples & 4)
+            row->t2 |= bit;
+        if (config[y] & DEBOUNCE_EAGER)
+            row->eager |= bit;
+    }
+}
+
+uint8_t debounce_update(struct debounce_row* row, uint8_t raw)
+{
+    /* Count up every key whose raw value disagrees with its debounced state;
+     * any key which agrees has its counter reset, so only an unbroken run of
+     * samples counts. */
+
+    uint8_t diff = raw ^ row->state;
+    row->c2 = (row->c2 ^ (row->c1 & row->c0)) & diff;
+    row->c1 = (row->c1 ^ row->c0) & diff;
+    row->c0 = ~row->c0 & diff;
+
+    /* A key changes when its counter reaches its threshold, or immediately
+     * if it's an eager key going down. */
+
+    uint8_t reached = ~((row->c0 ^ row->t0) | (row->c1 ^ row->t1) | (row->c2 ^ row->t2));
+    uint8_t changed = diff & (reached | (raw & row->eager));
+
+    row->state ^= changed;
+    row->c0 &= ~changed;
+    row->c1 &= ~changed;
+    row->c2 &= ~changed;
+    return changed;
+}
@@ -0,0 +1,37 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+
+/* Per-key settings. The low bits are the number of consecutive samples
+ * (1 to 7) a change must be seen for before it is accepted; DEBOUNCE_EAGER
+ * accepts a press on its first edge instead, so only releases are delayed. */
+
+#define DEBOUNCE_EAGER 0x80
+#define DEBOUNCE_SAMPLES_MASK 0x07
+
+/* Debounce state for the eight keys of one row. The counters are stored
+ * bit-sliced: c0, c1 and c2 are the three bits of eight separate counters,
+ * and likewise t0..t2 hold each key's threshold, so a whole row can be
+ * updated with a handful of bitwise operations. */
+
+struct debounce_row
+{
+    uint8_t state;
+    uint8_t c0, c1, c2;
+    uint8_t t0, t1, t2;
+    uint8_t eager;
+};
+
+/* config points at the eight per-key settings for this row. */
+
+extern void debounce_init(struct debounce_row* row, const uint8_t* config);
+
+/* Feeds in a raw sample. Returns a mask of the keys whose debounced state
+ * has changed; the new state is in row->state. */
+
+extern uint8_t debounce_update(struct debounce_row* row, uint8_t raw);
+
+#endif
@@ -0,0 +1,132 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "project.h"
+#include "usbkeycodes.h"
+#include "report.h"
+#include "inject.h"
+
+#define S INJECT_SHIFT
+
+static const uint8_t ascii[128] = {
+    ['\b'] = KEY_Delete,
+    ['\t'] = KEY_Tab,
+    ['\n'] = KEY_Enter,
+    ['\r'] = KEY_Enter,
+    [' ']  = KEY_Space,
+    ['!']  = S|KEY_1,           ['"'] = S|KEY_Quote,        ['#'] = S|KEY_3,
+    ['$']  = S|KEY_4,           ['%'] = S|KEY_5,            ['&'] = S|KEY_7,
+    ['\''] = KEY_Quote,         ['('] = S|KEY_9,            [')'] = S|KEY_0,
+    ['*']  = S|KEY_8,           ['+'] = S|KEY_Equals,       [','] = KEY_Comma,
+    ['-']  = KEY_Minus,         ['.'] = KEY_Period,         ['/'] = KEY_Slash,
+    ['0']  = KEY_0,             ['1'] = KEY_1,              ['2'] = KEY_2,
+    ['3']  = KEY_3,             ['4'] = KEY_4,              ['5'] = KEY_5,
+    ['6']  = KEY_6,             ['7'] = KEY_7,              ['8'] = KEY_8,
+    ['9']  = KEY_9,             [':'] = S|KEY_Semicolon,    [';'] = KEY_Semicolon,
+    ['<']  = S|KEY_Comma,       ['='] = KEY_Equals,         ['>'] = S|KEY_Period,
+    ['?']  = S|KEY_Slash,       ['@'] = S|KEY_2,            ['['] = KEY_LeftBracket,
+    ['\\'] = KEY_Backslash,     [']'] = KEY_RightBracket,   ['^'] = S|KEY_6,
+    ['_']  = S|KEY_Minus,       ['`'] = KEY_Grave,          ['{'] = S|KEY_LeftBracket,
+    ['|']  = S|KEY_Backslash,   ['}'] = S|KEY_RightBracket, ['~'] = S|KEY_Grave,
+};
+
+/* Single-producer, single-consumer, like the key event queue. */
+
+static uint8_t queue[INJECT_QUEUE_SIZE];
+static volatile uint8_t readptr = 0;
+static volatile uint8_t writeptr = 0;
+static uint8_t held[INJECT_BATCH];
+static uint8_t held_count;
+static bool held_shift;
+
+uint8_t inject_translate(char c)
+{
+    if ((c >= 'a') && (c <= 'z'))
+        return KEY_A + (c - 'a');
+    if ((c >= 'A') && (c <= 'Z'))
+        return S | (KEY_A + (c - 'A'));
+    if ((uint8_t) c < 128)
+        return ascii[(uint8_t) c];
+    return 0;
+}
+
+bool inject_put(uint8_t keystroke)
+{
+    uint8_t w = writeptr;
+    uint8_t next = (w+1) & (INJECT_QUEUE_SIZE-1);
+    if (next == readptr)
+        return false;
+    queue[w] = keystroke;
+    __DMB();
+    writeptr = next;
+    return true;
+}
+
+static bool was_held(const uint8_t* keys, uint8_t count, uint8_t keycode)
+{
+    for (int i=0; i<count; i++)
+        if (keys[i] == keycode)
+            return true;
+    return false;
+}
+
+/* Each report lets go of the last batch of keystrokes and presses the next
+ * one, which the host sees as those keys going up and the new ones going
+ * down, in that order (modifiers are processed before the key array). The
+ * host types new keys in the order they appear in the report: the boot
+ * report's slots are filled lowest first, so that's the order they were
+ * pressed in, but the NKRO report's bitmap is in usage order, so there a
+ * batch's keycodes have to ascend. A batch also ends at a change of shift,
+ * at a key the host would see as already down (in this batch or the last,
+ * or held on the keyboard), and before the report runs out of slots. So
+ * "hello" takes three reports: "hel", one which only lets go of them
+ * (pressing l again straight away would look to the host like it had been
+ * held), and "lo". Right shift is used so as not to fight with the
+ * physical left shift key. */
+
+#define BOOT_KEYS 6
+
+bool inject_step(bool nkro)
+{
+    uint8_t last[INJECT_BATCH];
+    uint8_t last_count = held_count;
+    memcpy(last, held, sizeof(last));
+
+    bool changed = false;
+    for (int i=0; i<held_count; i++)
+        changed |= report_release(REPORT_INJECTED, held[i]);
+    if (held_shift)
+        changed |= report_release(REPORT_INJECTED, KEY_RightShift);
+    held_count = 0;
+    held_shift = false;
+
+    uint8_t r = readptr;
+    while ((r != writeptr) && (held_count < INJECT_BATCH) && (report_count() < BOOT_KEYS))
+    {
+        __DMB();
+        uint8_t keystroke = queue[r];
+        uint8_t keycode = keystroke & ~S;
+        bool shift = keystroke & S;
+        if (held_count && (shift != held_shift))
+            break;
+        if (held_count && nkro && (keycode <= held[held_count-1]))
+            break;
+        if (was_held(last, last_count, keycode) || report_down(keycode))
+            break;
+
+        if (shift && !held_shift)
+            changed |= report_press(REPORT_INJECTED, KEY_RightShift);
+        held_shift = shift;
+        changed |= report_press(REPORT_INJECTED, keycode);
+        held[held_count++] = keycode;
+
+        __DMB();
+        r = (r+1) & (INJECT_QUEUE_SIZE-1);
+        readptr = r;
+    }
+    return changed;
+}
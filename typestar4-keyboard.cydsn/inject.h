@@ -0,0 +1,33 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef INJECT_H
+#define INJECT_H
+
+/* Types text sent from the host as keystrokes. Characters are translated
+ * (for a US layout) into keystrokes, a keycode with INJECT_SHIFT set if it
+ * needs shift, and queued; inject_step then types up to INJECT_BATCH of
+ * them per report. The keys are pressed as REPORT_INJECTED (see report.h),
+ * so they don't disturb keys held on the keyboard. */
+
+#define INJECT_SHIFT 0x80
+#define INJECT_QUEUE_SIZE 64
+#define INJECT_BATCH 6
+
+/* Returns the keystroke for an ASCII character, or 0 if it can't be typed. */
+
+extern uint8_t inject_translate(char c);
+
+/* Queues a keystroke, returning false if the queue is full. Only called from
+ * the main loop. */
+
+extern bool inject_put(uint8_t keystroke);
+
+/* Updates the report state for the next keystrokes, returning true if it
+ * changed. nkro says whether the host is being sent NKRO reports. Only
+ * called from report_poll(), once per report sent. */
+
+extern bool inject_step(bool nkro);
+
+#endif
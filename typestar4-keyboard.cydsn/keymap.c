@@ -0,0 +1,358 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "project.h"
+#include "keymap.h"
+#include "wheel.h"
+
+/* Looking a key up in the layer stack means walking down the active layers
+ * past any transparent entries. Rather than do that on every event, the
+ * answer for every position is precomputed whenever the set of active layers
+ * changes (which is rare), so each event is a single table lookup however
+ * many layers there are, and the RAM used doesn't grow with the number of
+ * layers. */
+
+static const uint8_t* base;
+static const struct keymap_overlay* overlays;
+static uint8_t num_layers;
+static const struct keymap_taphold* tapholds;
+static uint8_t num_tapholds;
+static uint8_t momentary;
+static uint8_t toggled;
+static uint8_t oneshot;
+static uint8_t used[KEYMAP_ROWS];
+static uint8_t resolved[KEYMAP_POSITIONS];
+static uint8_t down[KEYMAP_POSITIONS];
+
+static uint8_t lookup(uint8_t layer, uint8_t position)
+{
+    if (!layer)
+        return base[position];
+
+    const struct keymap_overlay* o = &overlays[layer-1];
+    uint8_t word = position >> 5;
+    uint32_t bit = 1UL << (position & 31);
+    uint32_t present = o->present->words[word];
+    if (!(present & bit))
+        return o->transparent ? KEY_Trans : 0;
+
+    uint8_t index = __builtin_popcount(present & (bit - 1));
+    for (int w=0; w<word; w++)
+        index += __builtin_popcount(o->present->words[w]);
+    return o->actions[index];
+}
+
+static void resolve(void)
+{
+    uint8_t active = momentary | toggled | oneshot | 1;
+
+    for (int position=0; position<KEYMAP_POSITIONS; position++)
+    {
+        uint8_t action = 0;
+        for (int layer=num_layers-1; layer>=0; layer--)
+        {
+            if (!(active & (1<<layer)))
+                continue;
+
+            uint8_t a = lookup(layer, position);
+            if (a != KEY_Trans)
+            {
+                action = a;
+                break;
+            }
+        }
+        resolved[position] = action;
+    }
+}
+
+/* At most one tap-hold key is undecided at a time: the one at position
+ * deciding, which is TAP_HOLD(deciding_taphold) and was pressed at most
+ * KEYMAP_TAPPING_MS ago. The timer only ever sets expired; everything
+ * else happens in the caller's context. */
+
+#define NO_POSITION 0xff
+
+static struct wheel_timer tapping_timer;
+static volatile bool expired;
+static uint8_t deciding = NO_POSITION;
+static uint8_t deciding_taphold;
+static uint8_t holding;
+static uint8_t tap_release;
+
+static void tapping_expired(struct wheel_timer* timer)
+{
+    expired = true;
+}
+
+/* A replacement keymap waits here until no keys are held; held counts the
+ * positions whose press did something. */
+
+static const keymap_layer_t* next_base;
+static const struct keymap_overlay* next_overlays;
+static uint8_t next_overlay_count;
+static const struct keymap_taphold* next_tapholds;
+static uint8_t next_taphold_count;
+static volatile bool replacing;
+static uint8_t held;
+
+static void load(const keymap_layer_t* b,
+    const struct keymap_overlay* o, uint8_t overlay_count,
+    const struct keymap_taphold* t, uint8_t taphold_count)
+{
+    base = &b[0][0][0];
+    overlays = o;
+    if (overlay_count > (KEYMAP_MAX_LAYERS-1))
+        overlay_count = KEYMAP_MAX_LAYERS-1;
+
+    /* An overlay whose presence bitmap doesn't match its entries would read
+     * past them, so it and everything above it are ignored. */
+
+    num_layers = 1;
+    while (num_layers <= overlay_count)
+    {
+        const struct keymap_overlay* overlay = &overlays[num_layers-1];
+        int entries = 0;
+        for (int w=0; w<KEYMAP_PRESENT_WORDS; w++)
+            entries += __builtin_popcount(overlay->present->words[w]);
+        if (entries != overlay->count)
+            break;
+        num_layers++;
+    }
+
+    tapholds = t;
+    num_tapholds = (taphold_count > KEYMAP_MAX_TAPHOLDS) ? KEYMAP_MAX_TAPHOLDS : taphold_count;
+    momentary = toggled = oneshot = 0;
+
+    for (int row=0; row<KEYMAP_ROWS; row++)
+    {
+        uint8_t mask = 0;
+        for (int layer=0; layer<num_layers; layer++)
+            for (int y=0; y<8; y++)
+            {
+                uint8_t a = lookup(layer, row*8 + y);
+                if (a && (a != KEY_Trans))
+                    mask |= 1<<y;
+            }
+        used[row] = mask;
+    }
+
+    resolve();
+}
+
+void keymap_init(const keymap_layer_t* b,
+    const struct keymap_overlay* o, uint8_t overlay_count,
+    const struct keymap_taphold* t, uint8_t taphold_count)
+{
+    wheel_init(&tapping_timer, tapping_expired);
+    load(b, o, overlay_count, t, taphold_count);
+}
+
+void keymap_replace(const keymap_layer_t* b,
+    const struct keymap_overlay* o, uint8_t overlay_count,
+    const struct keymap_taphold* t, uint8_t taphold_count)
+{
+    next_base = b;
+    next_overlays = o;
+    next_overlay_count = overlay_count;
+    next_tapholds = t;
+    next_taphold_count = taphold_count;
+    __DMB();
+    replacing = true;
+}
+
+bool keymap_replacing(void)
+{
+    return replacing;
+}
+
+uint8_t keymap_used(uint8_t row)
+{
+    return used[row];
+}
+
+static bool is_layer(uint8_t action)
+{
+    return (action & 0xf0) == LAYER_MO(0);
+}
+
+static bool is_taphold(uint8_t action)
+{
+    return (action & 0xfc) == TAP_HOLD(0);
+}
+
+/* Presses or releases a plain keycode or layer action. */
+
+static uint8_t apply(uint8_t action, bool pressed, uint16_t* output)
+{
+    if ((action & 0xf8) == LAYER_MO(0))
+    {
+        uint8_t bit = 1 << (action & 7);
+        if (pressed)
+            momentary |= bit;
+        else
+            momentary &= ~bit;
+        resolve();
+        return 0;
+    }
+
+    if ((action & 0xf8) == LAYER_TG(0))
+    {
+        if (pressed)
+        {
+            toggled ^= 1 << (action & 7);
+            resolve();
+        }
+        return 0;
+    }
+
+    if (!action)
+        return 0;
+    *output = action | (pressed ? 0 : KEYMAP_RELEASE);
+    return 1;
+}
+
+static uint8_t decide_hold(uint16_t* output)
+{
+    uint8_t n = deciding_taphold;
+    wheel_stop(&tapping_timer);
+    deciding = NO_POSITION;
+    if (n >= num_tapholds)
+        return 0;
+    holding |= 1 << n;
+    return apply(tapholds[n].hold, true, output);
+}
+
+static uint8_t decide_tap(uint16_t* output)
+{
+    uint8_t n = deciding_taphold;
+    wheel_stop(&tapping_timer);
+    deciding = NO_POSITION;
+
+    /* If the timer went off after all, the hold's press hasn't been output
+     * yet, so a held key which did nothing just does nothing. */
+
+    if (expired || (n >= num_tapholds))
+        return 0;
+
+    uint8_t tap = tapholds[n].tap;
+    if ((tap & 0xf8) == LAYER_MO(0))
+    {
+        oneshot |= 1 << (tap & 7);
+        resolve();
+        return 0;
+    }
+
+    tap_release = tap;
+    return apply(tap, true, output);
+}
+
+/* Any key being pressed makes the undecided key a hold, before the new key
+ * is looked up, so it sees the hold's layer; and a waiting replacement
+ * keymap goes in if nothing else is held. */
+
+static uint8_t begin_press(uint16_t* output)
+{
+    uint8_t count = 0;
+    if (deciding != NO_POSITION)
+        count += decide_hold(output);
+
+    if (replacing && !held)
+    {
+        __DMB();
+        load(next_base, next_overlays, next_overlay_count,
+            next_tapholds, next_taphold_count);
+        replacing = false;
+    }
+    return count;
+}
+
+static void clear_oneshot(uint8_t action)
+{
+    if (oneshot && !is_layer(action) && !is_taphold(action))
+    {
+        oneshot = 0;
+        resolve();
+    }
+}
+
+uint8_t keymap_event(uint8_t position, bool pressed, uint16_t* output)
+{
+    uint8_t count = 0;
+    uint8_t action;
+    if (pressed)
+    {
+        count += begin_press(output);
+
+        action = resolved[position];
+        down[position] = action;
+        if (action)
+            held++;
+        clear_oneshot(action);
+
+        if (is_taphold(action))
+        {
+            deciding = position;
+            deciding_taphold = action & 3;
+            expired = false;
+            wheel_start(&tapping_timer, KEYMAP_TAPPING_MS);
+            return count;
+        }
+    }
+    else
+    {
+        action = down[position];
+        down[position] = 0;
+        if (action)
+            held--;
+
+        if (is_taphold(action))
+        {
+            if (position == deciding)
+                return decide_tap(output);
+
+            uint8_t bit = 1 << (action & 3);
+            if (!(holding & bit))
+                return 0;
+            holding &= ~bit;
+            action = tapholds[action & 3].hold;
+        }
+    }
+
+    return count + apply(action, pressed, output + count);
+}
+
+uint8_t keymap_action_event(uint8_t action, bool pressed, uint16_t* output)
+{
+    uint8_t count = 0;
+    if (pressed)
+    {
+        count += begin_press(output);
+        held++;
+        clear_oneshot(action);
+    }
+    else
+        held--;
+
+    return count + apply(action, pressed, output + count);
+}
+
+bool keymap_pending(void)
+{
+    return tap_release || ((deciding != NO_POSITION) && expired);
+}
+
+uint8_t keymap_poll(uint16_t* output)
+{
+    uint8_t count = 0;
+    if (tap_release)
+    {
+        count += apply(tap_release, false, output);
+        tap_release = 0;
+    }
+    if ((deciding != NO_POSITION) && expired)
+        count += decide_hold(output + count);
+    return count;
+}
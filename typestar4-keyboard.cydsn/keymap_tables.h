@@ -0,0 +1,60 @@
+/* Generated by tools/keymapc.py from layout.txt and wiring.txt.
+ * Don't edit this; edit those and rebuild. */
+
+#if KEYMAP_ROWS != 9
+#error "the wiring doesn't match KEYMAP_ROWS"
+#endif
+
+/* Layer 0, Base. */
+
+static const keymap_layer_t base_layer = {
+    { KEY_J, KEY_L, KEY_N, KEY_P, KEY_I, KEY_K, KEY_M, KEY_O },
+    { KEY_Z, KEY_1, KEY_3, KEY_5, KEY_Y, KEY_0, KEY_2, KEY_4 },
+    { KEY_Period, KEY_Escape, KEY_Enter, KEY_Delete, KEY_Comma, KEY_Slash, KEY_Space, 0 },
+    { KEY_B, KEY_D, KEY_F, KEY_H, KEY_A, KEY_C, KEY_E, KEY_G },
+    { KEY_R, KEY_T, KEY_V, KEY_X, KEY_Q, KEY_S, KEY_U, KEY_W },
+    { KEY_7, KEY_9, KEY_LeftBracket, KEY_Quote, KEY_6, KEY_8, KEY_Minus, KEY_Semicolon },
+    { KEY_Equals, KEY_Menu, KEY_F7, KEY_F3, KEY_Tab, KEY_RightBracket, KEY_F6, KEY_F1 },
+    { KEY_F5, 0, 0, 0, KEY_F4, KEY_F2, 0, 0 },
+    { KEY_LeftShift, KEY_LeftControl, LAYER_MO(1), KEY_LeftGUI, 0, 0, 0, 0 }
+};
+
+/* Layer 1, Special: opaque, 24 entries. */
+
+static const uint8_t special_actions[] = {
+    KEY_Insert,
+    KEY_DeleteForward,
+    KEY_Right, KEY_PageDown, KEY_Left, KEY_End,
+    KEY_PageUp, KEY_Delete, KEY_Home, KEY_Down, KEY_Up,
+    KEY_F14,
+    KEY_NonUSBackslash, KEY_F10, KEY_NonUSHash, KEY_F13, KEY_F8,
+    KEY_F12, KEY_F11, KEY_F9,
+    KEY_Trans, KEY_Trans, KEY_Trans, KEY_Trans,
+};
+
+static const union keymap_present special_present = {
+    .rows = { 0x00, 0x01, 0x08, 0x56, 0xb9, 0x04, 0xe9, 0x31, 0x0f, 0x00, 0x00, 0x00 }
+};
+
+#define NUM_OVERLAYS 1
+
+static const struct keymap_overlay overlays[1] = {
+    {
+        .present = &special_present,
+        .actions = special_actions,
+        .count = 24,
+        .transparent = false
+    }
+};
+
+#define NUM_TAPHOLDS 0
+
+static const struct keymap_taphold tapholds[1] = {
+    { 0 }
+};
+
+#define NUM_COMBOS 0
+
+static const struct combo combos[1] = {
+    { .action = 0 }
+};
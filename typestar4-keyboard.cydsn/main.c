@@ -1,329 +1,1312 @@
-#include <stdbool.h>
-#include <stdio.h>
-#include "project.h"
-#include "usbkeycodes.h"
-
-enum
-{
-    ENDPOINT_KEYBOARD_IN = 4,
-    ENDPOINT_KEYBOARD_OUT = 5
-};
-
-enum
-{
-    MODIFIER_SHIFT = 1<<0,
-    MODIFIER_CONTROL = 1<<1,
-    MODIFIER_SPECIAL = 1<<2,
-    MODIFIER_ALT = 1<<3
-};
-
-static const uint8_t keycodes[8][8] = {
-    { KEY_J,              KEY_L,      KEY_N,           KEY_P,             KEY_I,     KEY_K,            KEY_M,     KEY_O },
-    { KEY_Z,              KEY_1,      KEY_3,           KEY_5,             KEY_Y,     KEY_0,            KEY_2,     KEY_4 },
-    { KEY_Period,         KEY_Escape, KEY_Enter,       KEY_Delete,        KEY_Comma, KEY_Slash,        KEY_Space, 0 },
-    { KEY_B,              KEY_D,      KEY_F,           KEY_H,             KEY_A,     KEY_C,            KEY_E,     KEY_G },
-    { KEY_R,              KEY_T,      KEY_V,           KEY_X,             KEY_Q,     KEY_S,            KEY_U,     KEY_W },
-    { KEY_7,              KEY_9,      KEY_LeftBracket, KEY_Quote,         KEY_6,     KEY_8,            KEY_Minus, KEY_Semicolon },
-    { KEY_Equals,         KEY_Menu,   KEY_F7,          KEY_F3,            KEY_Tab,   KEY_RightBracket, KEY_F6,    KEY_F1 },
-    { KEY_F5,             0,          0,               0,                 KEY_F4,    KEY_F2,           0,         0 },
-};
-
-static const uint8_t special_keycodes[8][8] = {
-    { 0,                  0,          0,               0,                 0,         0,                0,         0 },
-    { KEY_Insert,         0,          0,               0,                 0,         0,                0,         0 },
-    { 0,                  0,          0,               KEY_DeleteForward, 0,         0,                0,         0 },
-    { 0,                  KEY_Right,  KEY_PageDown,    0,                 KEY_Left,  0,                KEY_End,   0 },
-    { KEY_PageUp,         0,          0,               KEY_Delete,        KEY_Home,  KEY_Down,         0,         KEY_Up },
-    { 0,                  0,          KEY_F14,         0,                 0,         0,                0,         0 },
-    { KEY_NonUSBackslash, 0,          0,               KEY_F10,           0,         KEY_NonUSHash,    KEY_F13,   KEY_F8, },
-    { KEY_F12,            0,          0,               0,                 KEY_F11,   KEY_F9,           0,         0 },
-};
-
-struct usb_keyboard_data
-{
-    uint8_t modifiers;
-    uint8_t reserved;
-    uint8_t keys[6];
-};
-
-static struct usb_keyboard_data keyboard_state = {};
-static char screen[16];
-static int cursor;
-
-static void lcd_write_byte(bool rs, uint8_t data)
-{
-    CyPins_SetPin(LCDCTRL_E);
-
-    if (rs)
-        CyPins_SetPin(LCDCTRL_RS);
-    else
-        CyPins_ClearPin(LCDCTRL_RS);
-
-    LCDDATA_Write(data);
-    CyPins_ClearPin(LCDCTRL_RW);
-
-    CyDelayUs(2);
-    CyPins_ClearPin(LCDCTRL_E);
-    CyDelayUs(2);
-}
-
-static void LCD_Clear(void)
-{
-    lcd_write_byte(false, 0x01); /* clear */
-    CyDelay(2);
-}
-
-static void LCD_Init(void)
-{
-    CyDelay(200);
-
-    lcd_write_byte(false, 0x38); /* FUNCTION_SET + 8BIT */
-    CyDelay(5);
-    lcd_write_byte(false, 0x38); /* FUNCTION_SET + 8BIT */
-    CyDelay(1);
-    lcd_write_byte(false, 0x38); /* FUNCTION_SET + 8BIT */
-    CyDelay(1);
-        
-    lcd_write_byte(false, 0x0e); /* display control: display on, cursor on, blinking cursor pos off */
-    CyDelayUs(40);
-
-    LCD_Clear();
-}
-
-static void LCD_WriteChar(char c)
-{
-    lcd_write_byte(true, c);
-    CyDelayUs(40);
-}
-
-static void LCD_Seek(uint8_t pos)
-{
-    lcd_write_byte(false, 0x80 | pos); /* Set DDRAM address */
-    CyDelayUs(40);
-}
-
-static void LCD_Write(const char* s)
-{
-    uint8_t pos = 1;
-    LCD_Clear();
-    LCD_Seek(1);
-    for (;;)
-    {
-        char c = *s++;
-        if (!c)
-            return;
-        if (pos == 8)
-            LCD_Seek(0x3f);
-        if (pos == 16)
-            return;
-        LCD_WriteChar(c);
-        pos++;
-    }
-}
-
-static void SCR_Clear(void)
-{
-    memset(screen, ' ', sizeof(screen));
-    cursor = 0;
-}
-
-static void SCR_PutC(char c)
-{
-    switch (c)
-    {
-        case '\n':
-            SCR_Clear();
-            break;
-            
-        case '\r':
-            cursor = 0;
-            break;
-            
-        default:
-            if (cursor == 15)
-                SCR_Clear();
-            screen[cursor++] = c;
-            break;
-    }
-}
-
-static void SCR_Flush(void)
-{
-    LCD_Clear();
-    
-    LCD_Seek(0x01);
-    for (const char* p = screen; p != (screen+7); p++)
-        LCD_WriteChar(*p);
-    
-    LCD_Seek(0x3f);
-    for (const char* p = (screen+7); p != (screen+15); p++)
-        LCD_WriteChar(*p);
-    
-    if (cursor < 7)
-        LCD_Seek(0x01 + cursor);
-    else
-        LCD_Seek(0x3f - 6 + cursor);
-}
-
-static void SCR_Print(const char* s)
-{
-    for (;;)
-    {
-        char c = *s++;
-        if (!c)
-            break;
-        SCR_PutC(c);
-    }
-}
-
-static void SCR_PrintN(const char* s, uint32_t n)
-{
-    while (n--)
-        SCR_PutC(*s++);
-}
-
-static void print(const char* s)
-{
-    while (!USBFS_CDCIsReady())
-        ;
-    USBFS_PutString(s);
-}
-
-int main(void)
-{
-    CyGlobalIntEnable; /* Enable global interrupts. */
-    USBFS_Start(0, USBFS_DWR_POWER_OPERATION);
-
-    LCD_Init();
-            
-    for (;;)
-    {
-        if (!USBFS_GetConfiguration() || USBFS_IsConfigurationChanged())
-        {
-            LCD_Write("Waiting for USB");
-            LED_Write(1);
-            while (!USBFS_GetConfiguration())
-                ;
-            
-            LCD_Write("Setting up USB");
-            USBFS_CDC_Init();
-            
-            USBFS_EnableOutEP(ENDPOINT_KEYBOARD_OUT);
-            USBFS_LoadInEP(ENDPOINT_KEYBOARD_IN, (uint8_t*) &keyboard_state, sizeof(keyboard_state));
-            SCR_Clear();
-            SCR_Print("Ready");
-            SCR_Flush();
-            LED_Write(0);
-        }
-    
-        /* Only scan the keyboard if the master is ready. */
-        
-        if (USBFS_GetEPAckState(ENDPOINT_KEYBOARD_IN))
-        {            
-            /* Probe the modifier keys. */
-
-            static struct usb_keyboard_data newstate;
-            
-            KBDPROBE_Write(0xff);
-            CyDelayUs(150); /* Time for the capacitors to charge */
-            uint8_t mods = MODIFIERS_Read();
-            newstate.modifiers = 0;
-            if (mods & MODIFIER_SHIFT)
-                newstate.modifiers |= MOD_LeftShift;
-            if (mods & MODIFIER_CONTROL)
-                newstate.modifiers |= MOD_LeftControl;
-            if (mods & MODIFIER_ALT)
-                newstate.modifiers |= MOD_LeftGui;
-            bool special = mods & MODIFIER_SPECIAL;
-            
-            /* Probe the keyboard matrix. */
-        
-            memcpy(&keyboard_state.keys, &newstate.keys, sizeof(newstate.keys));
-            uint8_t allkeys = 0;
-            for (unsigned row=0; row<8; row++)
-            {
-                KBDPROBE_Write(1 << row);
-                CyDelayUs(100);
-                uint8_t keys = KBDSENSE_Read();
-                allkeys |= keys;
-
-                for (unsigned column=0; column<8; column++)
-                {
-                    uint8_t usbkeycode = (special ? special_keycodes : keycodes)[row][column];
-                    unsigned i = 0;
-                    
-                    /* Search for the key in the set. */
-                    
-                    while (i<sizeof(newstate.keys))
-                    {
-                        if (newstate.keys[i] == usbkeycode)
-                            break;
-                        i++;
-                    }
-                    
-                    if (keys & (1<<column))
-                    {
-                        /* Pressed --- add it to the keyboard set. */
-                    
-                        if (i != sizeof(newstate.keys))
-                        {
-                            /* Already in the set, so do nothing. */
-                        }
-                        else
-                        {
-                            /* Add it. */
-                            
-                            for (unsigned i=0; i<sizeof(newstate.keys); i++)
-                            {
-                                if (newstate.keys[i] == 0)
-                                {
-                                    newstate.keys[i] = usbkeycode;
-                                    break;
-                                }
-                            }
-                        }
-                    }
-                    else
-                    {
-                        /* Released --- remove it from the keyboard set. */
-                        
-                        if (i != sizeof(newstate.keys))
-                            newstate.keys[i] = 0;
-                    }
-                }
-            }
-            
-            /* In case of bugs, check to make sure that if no keys are pressed, the set is reset. */
-            
-            if (allkeys == 0)
-                memset(newstate.keys, 0, sizeof(newstate.keys));
-            
-            /* Detect changes. */
-            
-            if (memcmp(&newstate, &keyboard_state, sizeof(newstate)) != 0)
-            {
-                USBFS_LoadInEP(ENDPOINT_KEYBOARD_IN, (uint8_t*) &newstate, sizeof(newstate));
-                keyboard_state = newstate;
-                
-                static int led = 0;
-                led = !led;
-                //LED_Write(led);
-
-                CyDelay(20); // to prevent keybounce
-            }
-        }
-        
-        /* Handle the serial input. */
-
-        if (USBFS_DataIsReady())
-        {
-            while (USBFS_DataIsReady())
-            {
-                char inputbuffer[64];
-                int count = USBFS_GetAll((uint8_t*) inputbuffer);
-                SCR_PrintN(inputbuffer, count);
-            }
-            SCR_Flush();
-        }
-    }
-}
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "project.h"
+#include "usbkeycodes.h"
+#include "report.h"
+#include "debounce.h"
+#include "keymap.h"
+#include "mapstore.h"
+#include "perf.h"
+#include "inject.h"
+#include "trace.h"
+#include "wheel.h"
+#include "combo.h"
+#include "selftest.h"
+
+enum
+{
+    ENDPOINT_KEYBOARD_IN = 4,
+    ENDPOINT_KEYBOARD_OUT = 5
+};
+
+enum
+{
+    INTERFACE_KEYBOARD = 2
+};
+
+enum
+{
+    MODIFIER_SHIFT = 1<<0,
+    MODIFIER_CONTROL = 1<<1,
+    MODIFIER_SPECIAL = 1<<2,
+    MODIFIER_ALT = 1<<3
+};
+
+/* The matrix is scanned from the SysTick interrupt, one row per tick: each
+ * tick reads the row driven on the previous tick and then drives the next
+ * one, so processing one row overlaps the next one's settling. The
+ * modifiers are read with all probe lines driven, as a ninth row. Each tick
+ * lasts exactly as long as the row just driven needs to settle, which is
+ * measured at boot; because a new SysTick LOAD value only takes effect at
+ * the next reload, each interrupt sets up the length of the tick after the
+ * one it starts. */
+
+#define MODIFIER_ROW 8
+#define NUM_ROWS KEYMAP_ROWS
+#define PHASE_IDLE NUM_ROWS
+#define CYCLES_PER_US (BCLK__BUS_CLK__HZ / 1000000)
+#define FRAME_CYCLES (BCLK__BUS_CLK__HZ / 1000)
+
+/* Settle times. Each row is calibrated by charging the sense lines high
+ * and timing how long the pull-downs take to bring them back low with that
+ * row driven; that is the slow edge, as a pressed key pulls the line up
+ * through a strong driver. Each row gets its worst sample plus half again
+ * plus SETTLE_FLOOR_US. If any sample times out (a key is held down, say)
+ * or the samples for a row disagree by more than SETTLE_SPREAD_US, the
+ * whole calibration is thrown away and the conservative fixed delays used
+ * instead. No row ever gets less than SETTLE_MIN_US: every tick runs the
+ * interrupt, whose worst case (isr max in the perf counters) has to fit in
+ * well under that, or the main loop and the USB interrupts would be
+ * starved. */
+
+#define SETTLE_ROW_US 100
+#define SETTLE_MODIFIERS_US 150
+#define SETTLE_MIN_US 50
+#define SETTLE_FLOOR_US 5
+#define SETTLE_SPREAD_US 20
+#define SETTLE_TIMEOUT_US 500
+#define SETTLE_SAMPLES 8
+
+/* Once nothing has been held down for IDLE_US (about two seconds) and the
+ * LCD has nothing left to do, the scanner idles: all probe lines are left
+ * driven, the tick slows to IDLE_TICK_US, and each tick just checks whether
+ * anything at all is pressed. If so, full-rate scanning resumes, and the
+ * waking key is reported by the next pass as a normal press. The LCD queue
+ * drains at one entry per tick, so it's slower while idle, but still far
+ * faster than the screen is redrawn. */
+
+#define IDLE_US 2000000
+#define IDLE_TICK_US 1000
+
+/* Keys are debounced individually (see debounce.h). A press is reported on
+ * its first edge; a release only once the key has read as up for every pass
+ * in DEBOUNCE_US, or for seven passes if that's fewer, which is as far as
+ * the counters go. */
+
+#define DEBOUNCE_US 5000
+
+/* Key events are queued as a 16-bit word: the top bit is set for a press,
+ * and the bottom byte is the key's position in the keymap (row*8 +
+ * column, with the modifiers appearing as an extra row), or, from
+ * KEYMAP_POSITIONS up, a combo. */
+
+#define QUEUE_SIZE 64
+#define EVENT_PRESSED 0x8000
+#define EVENT_POSITION(e) ((e) & 0xff)
+#define NUM_POSITIONS (KEYMAP_POSITIONS + COMBO_MAX)
+
+/* The keymap, overlays, tap-hold keys and combos are generated from
+ * layout.txt and wiring.txt by tools/keymapc.py, which is run before every
+ * build. */
+
+#include "keymap_tables.h"
+
+/* This is a single-producer, single-consumer ring: writeptr is only written
+ * by the scanner and readptr only by report_poll(). The barriers make
+ * sure an entry is complete before the index publishing it is seen, and that
+ * the consumer has finished with an entry before handing the slot back.
+ *
+ * For the latency statistics, the producer also records the cycle count of
+ * the scan which queued the oldest event not yet taken into a report; the
+ * consumer clears it once the queue is empty, so the next event starts a
+ * new measurement. */
+
+static uint16_t queue[QUEUE_SIZE];
+static volatile uint8_t readptr = 0;
+static volatile uint8_t writeptr = 0;
+static uint32_t unreported_cycles;
+static volatile bool unreported;
+
+static uint8_t phase;
+static volatile bool idle;
+static uint16_t quiet_passes;
+static uint16_t idle_passes;
+static uint8_t debounce_passes;
+static uint32_t settle_cycles[NUM_ROWS];
+static uint32_t pass_cycles;
+static bool settle_calibrated;
+static uint32_t tick_running;
+static uint32_t tick_loaded;
+static uint32_t tick_stretch;
+static uint32_t clock_cycles;
+static volatile uint32_t tick_us;
+static volatile uint32_t scan_cycles;
+static volatile uint32_t sof_cycles;
+static struct debounce_row debounce[NUM_ROWS];
+static uint8_t raw[NUM_ROWS];
+
+static volatile uint32_t clock_us;
+static volatile uint32_t clock_ms;
+static uint32_t ms_us;
+static volatile bool usb_resumed;
+static volatile bool usb_ready;
+
+static uint8_t protocol;
+static char screen[16];
+static int cursor;
+
+static void post_keyevent(uint8_t position, bool pressed)
+{
+    uint8_t w = writeptr;
+    uint8_t next = (w+1) & (QUEUE_SIZE-1);
+    uint8_t r = readptr;
+    if (next != r)
+    {
+        queue[w] = position | (pressed ? EVENT_PRESSED : 0);
+        if (!unreported)
+        {
+            unreported_cycles = scan_cycles;
+            unreported = true;
+        }
+        __DMB();
+        writeptr = next;
+
+        uint8_t used = (next - r) & (QUEUE_SIZE-1);
+        if (used > perf.queue_high_water)
+            perf.queue_high_water = used;
+    }
+    else
+    {
+        perf.events_dropped++;
+        LED_Write(1);
+    }
+}
+
+static bool peek_keyevent(uint16_t* event)
+{
+    uint8_t r = readptr;
+    if (r == writeptr)
+        return false;
+    __DMB();
+    *event = queue[r];
+    return true;
+}
+
+static void pop_keyevent(void)
+{
+    __DMB();
+    readptr = (readptr+1) & (QUEUE_SIZE-1);
+}
+
+static uint8_t used_keys(uint8_t row)
+{
+    return keymap_used(row) | combo_used(row);
+}
+
+static void update_row(uint8_t row, uint8_t sense)
+{
+    struct debounce_row* d = &debounce[row];
+    uint8_t changed = debounce_update(d, sense);
+
+    /* Only the keys which changed are looked at. */
+
+    uint8_t events = changed & used_keys(row);
+    while (events)
+    {
+        uint8_t column = __builtin_ctz(events);
+        combo_event(row*8 + column, d->state & (1<<column));
+        events &= events - 1;
+    }
+}
+
+/* Sets the length of the tick after the one now running. */
+
+static void tick_load(uint32_t cycles)
+{
+    tick_loaded = cycles + tick_stretch;
+    tick_stretch = 0;
+    CySysTickSetReload(tick_loaded - 1);
+}
+
+/* Restarts the tick immediately, with the given lengths for this tick and
+ * the one after. The counter reloads on the clock after it is cleared, so
+ * LOAD can be changed again straight away. */
+
+static void tick_restart(uint32_t first, uint32_t second)
+{
+    CySysTickSetReload(first - 1);
+    CySysTickClear();
+    CySysTickSetReload(second - 1);
+    tick_running = first;
+    tick_loaded = second;
+    tick_stretch = 0;
+}
+
+/* The scan is phase-locked to the USB start-of-frame, so that a pass always
+ * ends SOF_LEAD_US before a SOF and the report loaded by the SOF interrupt
+ * carries the freshest possible scan. A pass is padded out to divide a
+ * frame exactly, and the bus clock is already frequency-locked to USB, so
+ * all this has to do is pull the phase round: at the end of each pass its
+ * offset from the last SOF is checked and, if it's out by more than a
+ * microsecond, a later tick is stretched to make up the difference. Ticks
+ * are only ever stretched, never shortened, so no row gets less than its
+ * settle time. Without the SOF interrupt there's no SOF time to lock to, and
+ * the scan runs free. */
+
+#define SOF_LEAD_US 20
+
+static void tick_lock_to_sof(uint32_t now, uint32_t pass)
+{
+    uint32_t since = now - sof_cycles;
+    if (since >= (2 * FRAME_CYCLES))
+        return; /* no recent SOF */
+
+    uint32_t target = FRAME_CYCLES - (SOF_LEAD_US * CYCLES_PER_US);
+    uint32_t delta = (target + FRAME_CYCLES - (since % FRAME_CYCLES)) % pass;
+    if ((delta > CYCLES_PER_US) && (delta < (pass - CYCLES_PER_US)))
+        tick_stretch = delta;
+}
+
+static bool lcd_busy(void);
+
+static void enter_idle(void)
+{
+    idle = true;
+    phase = PHASE_IDLE;
+    KBDPROBE_Write(0xff);
+    tick_restart(IDLE_TICK_US * CYCLES_PER_US, IDLE_TICK_US * CYCLES_PER_US);
+}
+
+static void leave_idle(void)
+{
+    quiet_passes = 0;
+    idle = false;
+    phase = 0;
+    KBDPROBE_Write(1 << phase);
+    tick_restart(settle_cycles[0], settle_cycles[1]);
+}
+
+static void check_idle(void)
+{
+    uint8_t down = 0;
+    for (int i=0; i<NUM_ROWS; i++)
+        down |= (debounce[i].state | raw[i]) & used_keys(i);
+
+    if (down || (readptr != writeptr) || lcd_busy() || selftest_running())
+        quiet_passes = 0;
+    else if (++quiet_passes == idle_passes)
+        enter_idle();
+}
+
+static uint8_t next_row(uint8_t row)
+{
+    return (row == MODIFIER_ROW) ? 0 : (row + 1);
+}
+
+static void drive_row(uint8_t row)
+{
+    KBDPROBE_Write((row == MODIFIER_ROW) ? 0xff : (1 << row));
+}
+
+static void scan_tick(uint32_t now)
+{
+    uint8_t row = phase;
+    if (row == PHASE_IDLE)
+    {
+        if (KBDSENSE_Read() || (MODIFIERS_Read() & used_keys(MODIFIER_ROW)) || selftest_running())
+            leave_idle();
+        else
+        {
+            tick_lock_to_sof(now, IDLE_TICK_US * CYCLES_PER_US);
+            tick_load(IDLE_TICK_US * CYCLES_PER_US);
+        }
+        return;
+    }
+
+    uint8_t sense = (row == MODIFIER_ROW) ? MODIFIERS_Read() : KBDSENSE_Read();
+    sense ^= selftest_mask(row, now);
+    phase = next_row(row);
+    drive_row(phase);
+    if (row == MODIFIER_ROW)
+        tick_lock_to_sof(now, pass_cycles);
+    tick_load(settle_cycles[next_row(phase)]);
+
+    /* The next row is now settling while this one is processed. */
+
+    if (sense != raw[row])
+    {
+        raw[row] = sense;
+        trace_record(row, sense);
+    }
+    update_row(row, sense);
+    if (row == MODIFIER_ROW)
+    {
+        trace_pass();
+        perf.scan_passes++;
+        check_idle();
+    }
+}
+
+/* Returns the time, in cycles, the sense lines take to fall after being
+ * charged high, or 0 if they never do. The row must already be driven. */
+
+static uint32_t measure_settle(uint8_t row)
+{
+    bool modifiers = (row == MODIFIER_ROW);
+    if (modifiers)
+    {
+        MODIFIERS_SetDriveMode(MODIFIERS_DM_STRONG);
+        MODIFIERS_Write(0xff);
+        CyDelayUs(1);
+        MODIFIERS_SetDriveMode(MODIFIERS_DM_RES_DWN);
+        MODIFIERS_Write(0x00);
+    }
+    else
+    {
+        KBDSENSE_SetDriveMode(KBDSENSE_DM_STRONG);
+        KBDSENSE_Write(0xff);
+        CyDelayUs(1);
+        KBDSENSE_SetDriveMode(KBDSENSE_DM_RES_DWN);
+        KBDSENSE_Write(0x00);
+    }
+
+    uint32_t start = perf_cycles();
+    for (;;)
+    {
+        uint32_t elapsed = perf_cycles() - start;
+        if (!(modifiers ? MODIFIERS_Read() : KBDSENSE_Read()))
+            return elapsed ? elapsed : 1;
+        if (elapsed > (SETTLE_TIMEOUT_US * CYCLES_PER_US))
+            return 0;
+    }
+}
+
+static bool calibrate_settle(void)
+{
+    for (int row=0; row<NUM_ROWS; row++)
+    {
+        uint32_t min = UINT32_MAX;
+        uint32_t max = 0;
+        drive_row(row);
+        CyDelayUs(SETTLE_TIMEOUT_US);
+        for (int i=0; i<SETTLE_SAMPLES; i++)
+        {
+            uint32_t t = measure_settle(row);
+            if (!t)
+                return false;
+            if (t < min)
+                min = t;
+            if (t > max)
+                max = t;
+        }
+        if ((max - min) > (SETTLE_SPREAD_US * CYCLES_PER_US))
+            return false;
+
+        uint32_t settle = max + (max / 2) + (SETTLE_FLOOR_US * CYCLES_PER_US);
+        if (settle < (SETTLE_MIN_US * CYCLES_PER_US))
+            settle = SETTLE_MIN_US * CYCLES_PER_US;
+        settle_cycles[row] = settle;
+    }
+    return true;
+}
+
+static void Scanner_Start(void)
+{
+    settle_calibrated = calibrate_settle();
+    if (!settle_calibrated)
+    {
+        for (int row=0; row<NUM_ROWS; row++)
+            settle_cycles[row] = SETTLE_ROW_US * CYCLES_PER_US;
+        settle_cycles[MODIFIER_ROW] = SETTLE_MODIFIERS_US * CYCLES_PER_US;
+    }
+
+    /* Pad the pass (by lengthening the modifier row) so that it divides a
+     * frame exactly, or is a whole number of frames, for the SOF lock. */
+
+    uint32_t sum = 0;
+    for (int row=0; row<NUM_ROWS; row++)
+        sum += settle_cycles[row];
+    if (sum <= FRAME_CYCLES)
+        pass_cycles = FRAME_CYCLES / (FRAME_CYCLES / sum);
+    else
+        pass_cycles = ((sum + FRAME_CYCLES - 1) / FRAME_CYCLES) * FRAME_CYCLES;
+    settle_cycles[MODIFIER_ROW] += pass_cycles - sum;
+
+    uint32_t pass_us = pass_cycles / CYCLES_PER_US;
+    uint32_t passes = (DEBOUNCE_US + pass_us - 1) / pass_us;
+    debounce_passes = (passes > DEBOUNCE_SAMPLES_MASK) ? DEBOUNCE_SAMPLES_MASK : passes;
+    uint8_t config[8];
+    memset(config, DEBOUNCE_EAGER | debounce_passes, sizeof(config));
+    for (int row=0; row<NUM_ROWS; row++)
+        debounce_init(&debounce[row], config);
+    idle_passes = IDLE_US / pass_us;
+
+    phase = MODIFIER_ROW;
+    drive_row(phase);
+}
+
+/* LCD commands are queued and sent from the SysTick interrupt at the pace
+ * the HD44780 can take them, so writing to the display costs the main loop
+ * a few instructions rather than milliseconds of CyDelay. Each entry is a
+ * byte for the controller, with LCD_RS set for data; LCD_WAIT entries just
+ * pause the queue for the given number of milliseconds. The LCD's R/W line
+ * is tied low and its data lines are output-only, so the busy flag can't be
+ * read; the worst-case execution times are used instead. */
+
+#define LCD_QUEUE_SIZE 64
+#define LCD_RS 0x100
+#define LCD_WAIT 0x8000
+#define LCD_COMMAND_US 40
+#define LCD_CLEAR_US 1640
+
+static uint16_t lcd_queue[LCD_QUEUE_SIZE];
+static volatile uint8_t lcd_readptr = 0;
+static volatile uint8_t lcd_writeptr = 0;
+static uint32_t lcd_wait_us;
+
+static void lcd_write_byte(bool rs, uint8_t data)
+{
+    CyPins_SetPin(LCDCTRL_E);
+
+    if (rs)
+        CyPins_SetPin(LCDCTRL_RS);
+    else
+        CyPins_ClearPin(LCDCTRL_RS);
+
+    LCDDATA_Write(data);
+    CyPins_ClearPin(LCDCTRL_RW);
+
+    CyDelayUs(1);
+    CyPins_ClearPin(LCDCTRL_E);
+}
+
+static void lcd_tick(void)
+{
+    if (lcd_wait_us > tick_us)
+    {
+        lcd_wait_us -= tick_us;
+        return;
+    }
+    lcd_wait_us = 0;
+
+    uint8_t r = lcd_readptr;
+    if (r == lcd_writeptr)
+        return;
+    __DMB();
+    uint16_t entry = lcd_queue[r];
+    __DMB();
+    lcd_readptr = (r+1) & (LCD_QUEUE_SIZE-1);
+
+    if (entry & LCD_WAIT)
+        lcd_wait_us = (uint32_t)(entry & ~LCD_WAIT) * 1000;
+    else
+    {
+        lcd_write_byte(entry & LCD_RS, entry);
+        if ((entry == 0x01) || (entry == 0x02)) /* clear, home */
+            lcd_wait_us = LCD_CLEAR_US;
+        else
+            lcd_wait_us = LCD_COMMAND_US;
+    }
+}
+
+static bool lcd_busy(void)
+{
+    return lcd_wait_us || (lcd_readptr != lcd_writeptr);
+}
+
+static uint8_t lcd_free(void)
+{
+    return (lcd_readptr - lcd_writeptr - 1) & (LCD_QUEUE_SIZE-1);
+}
+
+/* Never waits: if the queue is full the entry is dropped and counted, as
+ * print() does with CDC output. */
+
+static void lcd_put(uint16_t entry)
+{
+    uint8_t w = lcd_writeptr;
+    uint8_t next = (w+1) & (LCD_QUEUE_SIZE-1);
+    if (next == lcd_readptr)
+    {
+        perf.lcd_dropped++;
+        return;
+    }
+    lcd_queue[w] = entry;
+    __DMB();
+    lcd_writeptr = next;
+
+    uint8_t used = (next - lcd_readptr) & (LCD_QUEUE_SIZE-1);
+    if (used > perf.lcd_queue_high_water)
+        perf.lcd_queue_high_water = used;
+}
+
+static void tick_interrupt(void)
+{
+    uint32_t start = perf_cycles();
+    scan_cycles = start;
+
+    /* The tick which has just ended is the one loaded a tick ago. */
+
+    uint32_t ended = tick_running;
+    tick_running = tick_loaded;
+    tick_us = ended / CYCLES_PER_US;
+    clock_cycles += ended;
+    clock_us += clock_cycles / CYCLES_PER_US;
+    clock_cycles %= CYCLES_PER_US;
+
+    /* Ticks vary in length, so the timer wheel is ticked whenever another
+     * millisecond has gone by. clock_us wraps after about 71 minutes, which
+     * is fine for timing intervals, but uptimes are counted in milliseconds
+     * separately. */
+
+    ms_us += tick_us;
+    while (ms_us >= 1000)
+    {
+        ms_us -= 1000;
+        clock_ms++;
+        wheel_tick();
+    }
+    combo_poll();
+
+    scan_tick(start);
+    lcd_tick();
+    perf_isr(start);
+}
+
+static void Tick_Start(void)
+{
+    CySysTickStart();
+    CySysTickSetCallback(0, tick_interrupt);
+    tick_restart(settle_cycles[phase], settle_cycles[next_row(phase)]);
+}
+
+/* What the LCD is currently showing in each screen cell, and where its
+ * address counter is, so that SCR_Update can send only what's changed. */
+
+static char shown[15];
+static uint8_t lcd_address;
+
+static void LCD_Clear(void)
+{
+    lcd_put(0x01); /* clear */
+    memset(shown, ' ', sizeof(shown));
+    lcd_address = 0;
+}
+
+static void LCD_Init(void)
+{
+    lcd_put(LCD_WAIT | 200);
+
+    lcd_put(0x38); /* FUNCTION_SET + 8BIT */
+    lcd_put(LCD_WAIT | 5);
+    lcd_put(0x38); /* FUNCTION_SET + 8BIT */
+    lcd_put(LCD_WAIT | 1);
+    lcd_put(0x38); /* FUNCTION_SET + 8BIT */
+    lcd_put(LCD_WAIT | 1);
+        
+    lcd_put(0x0e); /* display control: display on, cursor on, blinking cursor pos off */
+
+    LCD_Clear();
+}
+
+static void LCD_WriteChar(char c)
+{
+    lcd_put(LCD_RS | (uint8_t)c);
+}
+
+static void LCD_Seek(uint8_t pos)
+{
+    lcd_put(0x80 | pos); /* Set DDRAM address */
+}
+
+static void LCD_Write(const char* s)
+{
+    uint8_t pos = 1;
+    LCD_Clear();
+    for (unsigned i=0; s[i] && (i<sizeof(shown)); i++)
+        shown[i] = s[i];
+    lcd_address = 0xff;
+    LCD_Seek(1);
+    for (;;)
+    {
+        char c = *s++;
+        if (!c)
+            return;
+        if (pos == 8)
+            LCD_Seek(0x3f);
+        if (pos == 16)
+            return;
+        LCD_WriteChar(c);
+        pos++;
+    }
+}
+
+static void SCR_Clear(void)
+{
+    memset(screen, ' ', sizeof(screen));
+    cursor = 0;
+}
+
+static void SCR_PutC(char c)
+{
+    switch (c)
+    {
+        case '\n':
+            SCR_Clear();
+            break;
+            
+        case '\r':
+            cursor = 0;
+            break;
+            
+        default:
+            if (cursor == 15)
+                SCR_Clear();
+            screen[cursor++] = c;
+            break;
+    }
+}
+
+/* Flushes are rate limited: the first one after a quiet period is drawn
+ * straight away, but any more within SCR_REFRESH_US of it are folded into a
+ * single redraw, so a stream of small CDC writes doesn't keep the LCD bus
+ * busy. A redraw is put off until the LCD queue has room for all of it (a
+ * seek and a character for each cell, and a last seek for the cursor), so
+ * none of it is dropped. */
+
+#define SCR_REFRESH_US 50000
+#define SCR_UPDATE_ENTRIES (15*2 + 1)
+
+static bool screen_dirty;
+static uint32_t screen_drawn_us;
+
+static void SCR_Flush(void)
+{
+    screen_dirty = true;
+}
+
+static void SCR_Update(void)
+{
+    if (!screen_dirty || ((clock_us - screen_drawn_us) < SCR_REFRESH_US)
+            || (lcd_free() < SCR_UPDATE_ENTRIES))
+        return;
+    screen_dirty = false;
+    screen_drawn_us = clock_us;
+
+    for (int i=0; i<15; i++)
+    {
+        if (screen[i] == shown[i])
+            continue;
+
+        uint8_t address = (i < 7) ? (0x01 + i) : (0x3f - 7 + i);
+        if (lcd_address != address)
+            LCD_Seek(address);
+        LCD_WriteChar(screen[i]);
+        shown[i] = screen[i];
+        lcd_address = address + 1;
+    }
+    
+    uint8_t address = (cursor < 7) ? (0x01 + cursor) : (0x3f - 6 + cursor);
+    if (lcd_address != address)
+    {
+        LCD_Seek(address);
+        lcd_address = address;
+    }
+}
+
+static void SCR_Print(const char* s)
+{
+    for (;;)
+    {
+        char c = *s++;
+        if (!c)
+            break;
+        SCR_PutC(c);
+    }
+}
+
+static void SCR_PrintN(const char* s, uint32_t n)
+{
+    while (n--)
+        SCR_PutC(*s++);
+}
+
+/* CDC traffic goes through a pair of rings serviced from the main loop, so
+ * that a slow (or absent) reader on the host never holds up the keyboard.
+ * Writes which don't fit in the TX ring are dropped and counted. Incoming
+ * packets are read straight from the endpoint into the RX ring, which has a
+ * packet's worth of slack past the end so a packet can always be read in one
+ * go; if there isn't room for a packet it's left in the endpoint, and the
+ * host is NAKed until there is. */
+
+#define CDC_TX_SIZE 256
+#define CDC_RX_SIZE 256
+#define CDC_PACKET_SIZE 64
+
+static uint8_t cdc_tx[CDC_TX_SIZE];
+static uint16_t cdc_tx_head, cdc_tx_tail;
+static uint8_t cdc_rx[CDC_RX_SIZE + CDC_PACKET_SIZE];
+static uint16_t cdc_rx_head, cdc_rx_tail;
+
+static void print(const char* s)
+{
+    while (*s)
+    {
+        uint16_t next = (cdc_tx_head+1) & (CDC_TX_SIZE-1);
+        if (next == cdc_tx_tail)
+        {
+            perf.cdc_tx_overflows++;
+            return;
+        }
+        cdc_tx[cdc_tx_head] = *s++;
+        cdc_tx_head = next;
+    }
+}
+
+/* Used for dumps, binary or text: waits for room in the ring rather than
+ * dropping anything. If the host takes nothing for WRITE_TIMEOUT_US (it has
+ * stopped reading, say, or suspended the bus) the rest of the output is
+ * dropped, until write_stalled is cleared for the next lot. Reports carry
+ * on meanwhile. */
+
+#define WRITE_TIMEOUT_US 100000
+
+static bool write_stalled;
+
+static void CDC_Service(void);
+static void report_poll(void);
+
+static void write_blocking(const uint8_t* data, uint8_t length)
+{
+    uint32_t since = clock_us;
+    while (length && !write_stalled)
+    {
+        uint16_t next = (cdc_tx_head+1) & (CDC_TX_SIZE-1);
+        if (next == cdc_tx_tail)
+        {
+            if (!usb_ready || ((clock_us - since) >= WRITE_TIMEOUT_US))
+                write_stalled = true;
+            CDC_Service();
+#if USBFS_SOF_ISR_REMOVE
+            report_poll();
+#endif
+            continue;
+        }
+        cdc_tx[cdc_tx_head] = *data++;
+        cdc_tx_head = next;
+        length--;
+        since = clock_us;
+    }
+}
+
+static void print_blocking(const char* s)
+{
+    write_blocking((const uint8_t*) s, strlen(s));
+}
+
+static void CDC_Service(void)
+{
+    if ((cdc_tx_head != cdc_tx_tail) && USBFS_CDCIsReady())
+    {
+        /* Send at most one byte less than a full packet, so that the host
+         * never needs a zero-length packet to see the end of a transfer. */
+
+        uint16_t count = ((cdc_tx_head > cdc_tx_tail) ? cdc_tx_head : CDC_TX_SIZE) - cdc_tx_tail;
+        if (count > (CDC_PACKET_SIZE-1))
+            count = CDC_PACKET_SIZE-1;
+        USBFS_PutData(&cdc_tx[cdc_tx_tail], count);
+        cdc_tx_tail = (cdc_tx_tail + count) & (CDC_TX_SIZE-1);
+    }
+
+    if (USBFS_DataIsReady())
+    {
+        uint16_t count = USBFS_GetCount();
+        uint16_t used = (cdc_rx_head - cdc_rx_tail) & (CDC_RX_SIZE-1);
+        if ((CDC_RX_SIZE - 1 - used) >= count)
+        {
+            USBFS_GetData(&cdc_rx[cdc_rx_head], count);
+            uint16_t end = cdc_rx_head + count;
+            if (end > CDC_RX_SIZE)
+                memcpy(&cdc_rx[0], &cdc_rx[CDC_RX_SIZE], end - CDC_RX_SIZE);
+            cdc_rx_head = end & (CDC_RX_SIZE-1);
+        }
+        else
+            perf.cdc_rx_stalls++;
+    }
+}
+
+static uint16_t CDC_Peek(const uint8_t** data)
+{
+    *data = &cdc_rx[cdc_rx_tail];
+    return ((cdc_rx_head >= cdc_rx_tail) ? cdc_rx_head : CDC_RX_SIZE) - cdc_rx_tail;
+}
+
+static void CDC_Consume(uint16_t count)
+{
+    cdc_rx_tail = (cdc_rx_tail + count) & (CDC_RX_SIZE-1);
+}
+
+static bool nkro_active(void)
+{
+#if REPORT_NKRO
+    return protocol == USBFS_PROTOCOL_REPORT;
+#else
+    return false;
+#endif
+}
+
+/* Reports are staged: queued events are folded into the next report as
+ * they arrive, so that it is ready to be loaded the moment the endpoint is
+ * free. Events are only held back for a later report if a key changes twice
+ * before the host has seen the first change, which would otherwise lose a
+ * tap altogether. All of this normally runs from the USB start-of-frame
+ * interrupt, once per millisecond, just after the scanner's last tick. If
+ * the USBFS component has been configured without its SOF interrupt, the
+ * main loop does it instead; the scan then isn't locked to the SOF either.
+ * Either way a report can go no more often than the endpoint's bInterval
+ * lets the host poll. */
+
+static uint8_t staged[sizeof(struct nkro_report)];
+static uint8_t staged_length;
+static bool staged_dirty;
+static bool staged_stamped;
+static uint32_t staged_cycles;
+static uint8_t touched[NUM_POSITIONS / 8];
+
+static void stage_report(void)
+{
+    if (!staged_dirty && !USBFS_GetEPAckState(ENDPOINT_KEYBOARD_IN))
+        perf.ep_stalls++;
+    staged_length = report_build(staged, nkro_active());
+    staged_dirty = true;
+}
+
+static void send_staged_report(void)
+{
+    USBFS_LoadInEP(ENDPOINT_KEYBOARD_IN, staged, staged_length);
+    perf.reports_sent++;
+    if (staged_stamped)
+    {
+        perf_latency(perf_cycles() - staged_cycles);
+        selftest_loaded(staged_cycles);
+    }
+    staged_dirty = false;
+    staged_stamped = false;
+    memset(touched, 0, sizeof(touched));
+}
+
+static bool apply_output(const uint16_t* output, uint8_t count)
+{
+    bool changed = false;
+    for (int i=0; i<count; i++)
+    {
+        uint8_t keycode = output[i];
+        if (output[i] & KEYMAP_RELEASE)
+            changed |= report_release(REPORT_KEYBOARD, keycode);
+        else
+            changed |= report_press(REPORT_KEYBOARD, keycode);
+    }
+    return changed;
+}
+
+static void drain_keyevents(void)
+{
+    bool changed = false;
+    uint16_t output[KEYMAP_MAX_OUTPUT];
+    uint16_t event;
+
+    /* Output the keymap makes by itself (the end of a tap, or a hold whose
+     * time is up) waits for the report before it to go, and queued events
+     * wait behind it. */
+
+    if (keymap_pending())
+    {
+        if (staged_dirty)
+            return;
+        changed = apply_output(output, keymap_poll(output));
+    }
+
+    while (!keymap_pending() && peek_keyevent(&event))
+    {
+        uint8_t position = EVENT_POSITION(event);
+        uint8_t row = position >> 3;
+        uint8_t bit = 1 << (position & 7);
+        if (touched[row] & bit)
+            break;
+
+        bool pressed = event & EVENT_PRESSED;
+        uint8_t count;
+        if (position >= KEYMAP_POSITIONS)
+            count = keymap_action_event(combo_action(position - KEYMAP_POSITIONS), pressed, output);
+        else
+            count = keymap_event(position, pressed, output);
+        if (apply_output(output, count))
+        {
+            touched[row] |= bit;
+            changed = true;
+            if (!staged_stamped)
+            {
+                staged_cycles = unreported_cycles;
+                staged_stamped = true;
+            }
+        }
+
+        pop_keyevent();
+    }
+
+    if (unreported)
+    {
+        uint8_t state = CyEnterCriticalSection();
+        if (readptr == writeptr)
+            unreported = false;
+        CyExitCriticalSection(state);
+    }
+
+    if (changed)
+        stage_report();
+}
+
+static void report_poll(void)
+{
+    if (!usb_ready)
+        return;
+
+    /* The host may switch between the boot and report protocols at any
+     * time (SET_PROTOCOL); if so, resend in the new format. */
+
+    if (USBFS_GetProtocol(INTERFACE_KEYBOARD) != protocol)
+    {
+        protocol = USBFS_GetProtocol(INTERFACE_KEYBOARD);
+        stage_report();
+    }
+
+    drain_keyevents();
+    if (USBFS_GetEPAckState(ENDPOINT_KEYBOARD_IN))
+    {
+        /* Injected keystrokes only go into reports with nothing else
+         * pending, so each batch gets a report of its own. */
+
+        if (!staged_dirty && inject_step(nkro_active()))
+            stage_report();
+        if (staged_dirty)
+            send_staged_report();
+    }
+}
+
+#if !USBFS_SOF_ISR_REMOVE
+
+/* Called by the USBFS component on every start-of-frame. */
+
+void USBFS_SOF_ISR_EntryCallback(void)
+{
+    uint32_t now = perf_cycles();
+    perf_sof_offset(now - scan_cycles);
+    sof_cycles = now;
+    report_poll();
+}
+
+#endif
+
+/* Called by the USBFS component when the host has taken a report. */
+
+void USBFS_EP_4_ISR_EntryCallback(void)
+{
+    selftest_acked();
+}
+
+/* Called by the USBFS component when the D+ line interrupt fires, which it
+ * arms on suspend to catch the host resuming the bus. */
+
+void USBFS_DP_ISR_EntryCallback(void)
+{
+    usb_resumed = true;
+}
+
+/* The bus has gone quiet, so the host has suspended us. The USB block is put
+ * to sleep and the scanner idled, and the CPU sleeps until either the host
+ * resumes the bus or, if the host has allowed it, a key event is queued, in
+ * which case we signal remote wakeup. Keys pressed while remote wakeup is
+ * disabled are still queued, and get reported once the host comes back. */
+
+#define USB_ACTIVITY_MS 10
+#define USB_RESUME_MS 10
+
+static void usb_suspend(void)
+{
+    bool remote_wakeup = false;
+
+    usb_resumed = false;
+    USBFS_Suspend();
+
+    uint8_t state = CyEnterCriticalSection();
+    if (!idle)
+        enter_idle();
+    CyExitCriticalSection(state);
+
+    while (!usb_resumed)
+    {
+        if ((readptr != writeptr) && USBFS_RWUEnabled())
+        {
+            remote_wakeup = true;
+            break;
+        }
+        __WFI();
+    }
+
+    USBFS_Resume();
+    if (remote_wakeup)
+    {
+        /* Drive resume signalling (the K state) for 1 to 15ms. */
+        USBFS_Force(USBFS_FORCE_K);
+        CyDelay(USB_RESUME_MS);
+        USBFS_Force(USBFS_FORCE_NONE);
+    }
+}
+
+/* Bytes received over CDC go to the screen, except that ESC introduces a
+ * one-letter command:
+ *
+ *   ESC c    dump the performance counters
+ *   ESC d    dump the scan trace (in binary; see trace.h)
+ *   ESC k    type everything up to the next ESC as keystrokes
+ *   ESC l    upload a keymap image (see mapstore.h)
+ *   ESC s    run the latency self-test (see selftest.h)
+ *   ESC t    show the scan timings
+ *
+ * Text being typed is only consumed as fast as the injection queue drains,
+ * so the CDC receive ring fills up and the host is made to wait rather than
+ * anything being dropped. A keymap image is binary, so everything after
+ * ESC l is taken as part of it until the whole image has arrived, or
+ * nothing has for LOAD_TIMEOUT_US.
+ */
+
+#define LOAD_TIMEOUT_US 1000000
+
+static bool cdc_typing;
+static bool cdc_loading;
+static uint32_t load_us;
+
+static void print_timings(void)
+{
+    char buffer[80];
+    int n = snprintf(buffer, sizeof(buffer), "settle (%s):",
+        settle_calibrated ? "calibrated" : "fallback");
+    for (int row=0; row<NUM_ROWS; row++)
+        n += snprintf(buffer + n, sizeof(buffer) - n, " %lu",
+            (unsigned long) (settle_cycles[row] / CYCLES_PER_US));
+    snprintf(buffer + n, sizeof(buffer) - n, "us\r\n");
+    print(buffer);
+
+    snprintf(buffer, sizeof(buffer), "pass: %luus debounce=%u passes\r\n",
+        (unsigned long) (pass_cycles / CYCLES_PER_US), debounce_passes);
+    print(buffer);
+}
+
+/* The self-test presses left shift, which is harmless. */
+
+#define SELFTEST_POSITION (MODIFIER_ROW*8 + 0)
+
+static void run_command(uint8_t c)
+{
+    switch (c)
+    {
+        case 'c':
+            write_stalled = false;
+            perf_dump(print_blocking, clock_ms);
+            break;
+
+        case 'd':
+            write_stalled = false;
+            trace_dump(write_blocking, NUM_ROWS);
+            break;
+
+        case 'k':
+            cdc_typing = true;
+            break;
+
+        case 'l':
+            cdc_loading = mapstore_begin();
+            load_us = clock_us;
+            if (!cdc_loading)
+                print("Keymap busy\r\n");
+            break;
+
+        case 's':
+            write_stalled = false;
+            if (selftest_start(SELFTEST_POSITION, SELFTEST_ITERATIONS))
+                print("Self-test running\r\n");
+            else
+                print("Self-test already running\r\n");
+            break;
+
+        case 't':
+            print_timings();
+            break;
+    }
+}
+
+static void CDC_Process(void)
+{
+    static bool escaped = false;
+
+    for (;;)
+    {
+        const uint8_t* data;
+        uint16_t count = CDC_Peek(&data);
+        if (!count)
+            break;
+
+        uint16_t i = 0;
+        bool full = false;
+        while ((i < count) && !full)
+        {
+            if (cdc_loading)
+            {
+                load_us = clock_us;
+                switch (mapstore_put(data[i++]))
+                {
+                    case MAPSTORE_DONE:
+                        print("Keymap loaded\r\n");
+                        cdc_loading = false;
+                        break;
+
+                    case MAPSTORE_FAILED:
+                        print("Keymap load failed\r\n");
+                        cdc_loading = false;
+                        break;
+                }
+                continue;
+            }
+
+            if (escaped)
+            {
+                escaped = false;
+                run_command(data[i++]);
+                continue;
+            }
+
+            uint16_t start = i;
+            if (cdc_typing)
+            {
+                while ((i < count) && (data[i] != '\x1b'))
+                {
+                    uint8_t keystroke = inject_translate(data[i]);
+                    if (keystroke && !inject_put(keystroke))
+                    {
+                        full = true;
+                        break;
+                    }
+                    i++;
+                }
+            }
+            else
+            {
+                while ((i < count) && (data[i] != '\x1b'))
+                    i++;
+                if (i != start)
+                {
+                    SCR_PrintN((const char*) &data[start], i - start);
+                    SCR_Flush();
+                }
+            }
+            if (!full && (i < count))
+            {
+                cdc_typing = false;
+                escaped = true;
+                i++;
+            }
+        }
+
+        CDC_Consume(i);
+        if (full)
+            break;
+    }
+}
+
+/* Brings the USB side up, or back up after the host reconfigures us,
+ * without blocking: the scanner and the LCD keep running meanwhile, and
+ * keys pressed before it's done stay queued until they can be sent. */
+
+static uint32_t usb_activity_us;
+
+static void usb_poll(void)
+{
+    static bool waiting = false;
+
+    bool changed = USBFS_IsConfigurationChanged();
+    if (!USBFS_GetConfiguration())
+    {
+        usb_ready = false;
+        if (!waiting)
+        {
+            LCD_Write("Waiting for USB");
+            LED_Write(1);
+            waiting = true;
+        }
+        return;
+    }
+    if (usb_ready && !changed)
+        return;
+
+    usb_ready = false;
+    USBFS_CDC_Init();
+    USBFS_EnableOutEP(ENDPOINT_KEYBOARD_OUT);
+    protocol = USBFS_GetProtocol(INTERFACE_KEYBOARD);
+    stage_report();
+    send_staged_report();
+    usb_ready = true;
+    waiting = false;
+    usb_activity_us = clock_us;
+    if (!perf.first_report_ms)
+        perf.first_report_ms = clock_ms;
+
+    SCR_Clear();
+    SCR_Print("Ready");
+    SCR_Flush();
+    LED_Write(0);
+}
+
+int main(void)
+{
+    CyGlobalIntEnable; /* Enable global interrupts. */
+    perf_init();
+    USBFS_Start(0, USBFS_DWR_POWER_OPERATION);
+    combo_init(combos, NUM_COMBOS, post_keyevent);
+    if (!mapstore_init())
+        keymap_init(&base_layer, overlays, NUM_OVERLAYS, tapholds, NUM_TAPHOLDS);
+    Scanner_Start();
+    Tick_Start();
+
+    /* This only queues the LCD's power-up sequence, which the tick then
+     * plays out while USB enumerates. */
+
+    LCD_Init();
+
+    for (;;)
+    {
+        usb_poll();
+#if USBFS_SOF_ISR_REMOVE
+        report_poll();
+#endif
+        if (usb_ready)
+        {
+            /* An active bus sees a SOF every millisecond. */
+
+            if ((clock_us - usb_activity_us) >= (USB_ACTIVITY_MS * 1000))
+            {
+                usb_activity_us = clock_us;
+                if (!USBFS_CheckActivity())
+                    usb_suspend();
+            }
+
+            /* Handle the serial input. */
+
+            if (cdc_loading && ((clock_us - load_us) >= LOAD_TIMEOUT_US))
+            {
+                print("Keymap load timed out\r\n");
+                cdc_loading = false;
+            }
+            CDC_Service();
+            CDC_Process();
+            selftest_poll(print_blocking);
+        }
+
+        SCR_Update();
+
+        /* Nothing to do until the next interrupt. */
+
+        if (idle)
+            __WFI();
+    }
+}
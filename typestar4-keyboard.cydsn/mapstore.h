@@ -0,0 +1,78 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef MAPSTORE_H
+#define MAPSTORE_H
+
+/* Keymaps can be replaced at runtime by uploading a keymap image, which is
+ * stored in one of two banks of flash. An upload always goes to the bank
+ * which isn't in use and is only switched to once its CRC has been checked,
+ * so a failed or interrupted upload leaves the old keymap in place. At boot
+ * the newest valid bank is used, or the built-in keymap if there isn't one.
+ * Images are used straight out of flash, not copied.
+ *
+ * An image, all little-endian, is a struct mapstore_header followed by:
+ *
+ *   - the base layer, KEYMAP_POSITIONS bytes;
+ *   - for each overlay, a struct mapstore_overlay followed by its count
+ *     entries;
+ *   - the tap-hold definitions, as struct keymap_taphold.
+ *
+ * Each of these starts on a four-byte boundary, with zero padding. length
+ * covers the whole image, including the header; crc is the CRC-32 (as used
+ * by zlib) of everything after it. sequence is filled in by the firmware
+ * when the image is stored, and whatever was uploaded is ignored.
+ *
+ * Images don't store combos: those are built into the firmware, from
+ * layout.txt, and stay the same whichever keymap is loaded. */
+
+#define MAPSTORE_BANK_SIZE 1024
+#define MAPSTORE_VERSION 1
+
+struct mapstore_header
+{
+    char magic[4];              /* "KMAP" */
+    uint16_t sequence;
+    uint16_t length;
+    uint32_t crc;
+    uint8_t version;
+    uint8_t rows;                 /* KEYMAP_ROWS */
+    uint8_t overlays;
+    uint8_t tapholds;
+};
+
+struct mapstore_overlay
+{
+    union keymap_present present;
+    uint8_t count;
+    uint8_t transparent;
+    uint8_t reserved[2];
+};
+
+/* Loads the newest valid image, returning false if there isn't one. */
+
+extern bool mapstore_init(void);
+
+/* An upload is started with mapstore_begin(), which returns false if the
+ * previous upload hasn't been switched to yet, and then fed a byte at a
+ * time until it returns MAPSTORE_DONE or MAPSTORE_FAILED. Flash is written
+ * a row at a time as the image arrives, which stalls the CPU for a few
+ * milliseconds; MAPSTORE_ROW says that has just happened, for transports
+ * which need to pace the sender. A failed upload still takes bytes until
+ * the end of the image, as given by its header, before returning
+ * MAPSTORE_FAILED; if the header was bad it takes them forever, so the
+ * caller should also give up once nothing has arrived for a while. */
+
+enum
+{
+    MAPSTORE_MORE,
+    MAPSTORE_ROW,
+    MAPSTORE_DONE,
+    MAPSTORE_FAILED
+};
+
+extern bool mapstore_begin(void);
+extern uint8_t mapstore_put(uint8_t byte);
+
+#endif
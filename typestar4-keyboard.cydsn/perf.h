@@ -0,0 +1,62 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+/* Performance counters. Each field has exactly one writer: the isr_*,
+ * queue_*, events_dropped and scan_passes fields are only written from the
+ * SysTick interrupt; reports_sent, ep_stalls and the latency_* fields by
+ * whatever sends reports, which is the USB SOF interrupt if the USBFS
+ * component has one and the main loop if not (see report_poll() in
+ * main.c); the sof_* fields only from the SOF interrupt; and the rest only
+ * from the main loop, so nobody needs to lock to update them. The ISR timings are in CPU
+ * cycles, measured with the DWT cycle counter. Latency is measured from
+ * the scan which saw a key to the report carrying it being loaded, and
+ * sof_offset is how long before each SOF the scanner last ran. The timings
+ * cover the period since the last dump. first_report_ms is the time from
+ * reset to the first report after USB configuration. */
+
+struct perf_counters
+{
+    uint32_t isr_count;
+    uint32_t isr_cycles_min;
+    uint32_t isr_cycles_max;
+    uint64_t isr_cycles_total;
+    uint32_t queue_high_water;
+    uint32_t events_dropped;
+    uint32_t scan_passes;
+    uint32_t reports_sent;
+    uint32_t ep_stalls;
+    uint32_t latency_count;
+    uint32_t latency_cycles_min;
+    uint32_t latency_cycles_max;
+    uint64_t latency_cycles_total;
+    uint32_t sof_offset_cycles_min;
+    uint32_t sof_offset_cycles_max;
+    uint32_t first_report_ms;
+    uint32_t lcd_queue_high_water;
+    uint32_t lcd_dropped;
+    uint32_t cdc_tx_overflows;
+    uint32_t cdc_rx_stalls;
+};
+
+extern struct perf_counters perf;
+
+static inline uint32_t perf_cycles(void)
+{
+    return DWT->CYCCNT;
+}
+
+extern void perf_init(void);
+extern void perf_isr(uint32_t start_cycles);
+extern void perf_latency(uint32_t cycles);
+extern void perf_sof_offset(uint32_t cycles);
+
+/* Takes a consistent snapshot of the counters and writes it out a line at
+ * a time through print. now_ms is used to work out the scan rate. */
+
+extern void perf_dump(void (*print)(const char* s), uint32_t now_ms);
+
+#endif
@@ -0,0 +1,209 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "project.h"
+#include "perf.h"
+#include "selftest.h"
+
+#define CYCLES_PER_US (BCLK__BUS_CLK__HZ / 1000000)
+
+/* WAITING belongs to the scanner, INJECTED to whatever sends reports (the
+ * SOF interrupt or the main loop), LOADED to the endpoint interrupt, and
+ * IDLE and FINISHED to the main loop. */
+
+enum
+{
+    IDLE,
+    WAITING,
+    INJECTED,
+    LOADED,
+    FINISHED
+};
+
+struct latency
+{
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint16_t buckets[SELFTEST_BUCKETS];
+};
+
+static volatile uint8_t state = IDLE;
+static uint8_t test_row;
+static uint8_t test_bit;
+static bool down;
+static uint16_t remaining;
+static uint16_t samples;
+
+/* While WAITING, when the last edge was ACKed; otherwise, the scan which
+ * saw the current edge. */
+
+static uint32_t edge_cycles;
+static uint32_t load_cycles;
+static struct latency to_load;
+static struct latency to_ack;
+
+static void latency_init(struct latency* l)
+{
+    memset(l, 0, sizeof(*l));
+    l->min = UINT32_MAX;
+}
+
+static void latency_add(struct latency* l, uint32_t cycles)
+{
+    if (cycles < l->min)
+        l->min = cycles;
+    if (cycles > l->max)
+        l->max = cycles;
+    l->total += cycles;
+
+    uint32_t bucket = cycles / (SELFTEST_BUCKET_US * CYCLES_PER_US);
+    if (bucket >= SELFTEST_BUCKETS)
+        bucket = SELFTEST_BUCKETS - 1;
+    l->buckets[bucket]++;
+}
+
+bool selftest_start(uint8_t position, uint16_t iterations)
+{
+    if (state != IDLE)
+        return false;
+
+    latency_init(&to_load);
+    latency_init(&to_ack);
+    test_row = position >> 3;
+    test_bit = 1 << (position & 7);
+    down = false;
+    remaining = iterations;
+    samples = 0;
+    edge_cycles = perf_cycles();
+    __DMB();
+    state = WAITING;
+    return true;
+}
+
+bool selftest_running(void)
+{
+    uint8_t s = state;
+    return (s != IDLE) && (s != FINISHED);
+}
+
+uint8_t selftest_mask(uint8_t row, uint32_t scan_cycles)
+{
+    if (row != test_row)
+        return 0;
+
+    if ((state == WAITING)
+            && ((int32_t) (scan_cycles - edge_cycles) >= (int32_t) (SELFTEST_GAP_US * CYCLES_PER_US)))
+    {
+        down = !down;
+        edge_cycles = scan_cycles;
+        state = INJECTED;
+    }
+    return down ? test_bit : 0;
+}
+
+void selftest_loaded(uint32_t event_cycles)
+{
+    if ((state == INJECTED) && ((int32_t) (event_cycles - edge_cycles) >= 0))
+    {
+        load_cycles = perf_cycles();
+        state = LOADED;
+    }
+}
+
+void selftest_acked(void)
+{
+    if (state != LOADED)
+        return;
+
+    uint32_t now = perf_cycles();
+    if (down)
+    {
+        latency_add(&to_load, load_cycles - edge_cycles);
+        latency_add(&to_ack, now - edge_cycles);
+        samples++;
+    }
+    else if (!--remaining)
+    {
+        state = FINISHED;
+        return;
+    }
+    edge_cycles = now;
+    state = WAITING;
+}
+
+static unsigned long us(uint64_t cycles)
+{
+    return (unsigned long) (cycles / CYCLES_PER_US);
+}
+
+static void print_latency(void (*print)(const char* s), const char* name, const struct latency* l)
+{
+    char buffer[80];
+    snprintf(buffer, sizeof(buffer), "selftest: %s min=%luus avg=%luus max=%luus\r\n",
+        name, us(l->min), us(l->total / samples), us(l->max));
+    print(buffer);
+}
+
+static void print_results(void (*print)(const char* s))
+{
+    char buffer[80];
+    snprintf(buffer, sizeof(buffer), "selftest: n=%u\r\n", samples);
+    print(buffer);
+    if (!samples)
+        return;
+
+    print_latency(print, "load", &to_load);
+    print_latency(print, "ack", &to_ack);
+    for (int i=0; i<SELFTEST_BUCKETS; i++)
+    {
+        if (!to_load.buckets[i] && !to_ack.buckets[i])
+            continue;
+        if (i == (SELFTEST_BUCKETS-1))
+            snprintf(buffer, sizeof(buffer), "  >=%luus: load=%u ack=%u\r\n",
+                (unsigned long) (i * SELFTEST_BUCKET_US), to_load.buckets[i], to_ack.buckets[i]);
+        else
+            snprintf(buffer, sizeof(buffer), "  %lu-%luus: load=%u ack=%u\r\n",
+                (unsigned long) (i * SELFTEST_BUCKET_US), (unsigned long) ((i+1) * SELFTEST_BUCKET_US),
+                to_load.buckets[i], to_ack.buckets[i]);
+        print(buffer);
+    }
+}
+
+void selftest_poll(void (*print)(const char* s))
+{
+    uint8_t s = state;
+    if (s == FINISHED)
+    {
+        print_results(print);
+        state = IDLE;
+        return;
+    }
+    if ((s != INJECTED) && (s != LOADED))
+        return;
+
+    /* The key is let go of, so it doesn't stay stuck down. */
+
+    bool timed_out = false;
+    uint8_t cs = CyEnterCriticalSection();
+    s = state;
+    if (((s == INJECTED) || (s == LOADED))
+            && ((int32_t) (perf_cycles() - edge_cycles) > (int32_t) (SELFTEST_TIMEOUT_US * CYCLES_PER_US)))
+    {
+        down = false;
+        state = IDLE;
+        timed_out = true;
+    }
+    CyExitCriticalSection(cs);
+
+    if (timed_out)
+    {
+        print("selftest: timed out\r\n");
+        print_results(print);
+    }
+}
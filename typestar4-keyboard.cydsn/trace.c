@@ -0,0 +1,78 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "project.h"
+#include "trace.h"
+
+#define DUMP_CHUNK 64
+
+static struct trace_entry ring[TRACE_ENTRIES];
+static uint16_t head;
+static uint16_t count;
+static uint32_t passes;
+static volatile bool paused;
+
+static void put(uint16_t delta, uint8_t row, uint8_t sense)
+{
+    struct trace_entry* e = &ring[head];
+    e->delta = delta;
+    e->row = row;
+    e->sense = sense;
+    head = (head+1) % TRACE_ENTRIES;
+    if (count < TRACE_ENTRIES)
+        count++;
+}
+
+void trace_pass(void)
+{
+    passes++;
+}
+
+void trace_record(uint8_t row, uint8_t sense)
+{
+    if (paused)
+        return;
+
+    while (passes > UINT16_MAX)
+    {
+        put(UINT16_MAX, TRACE_ROW_TIME, 0);
+        passes -= UINT16_MAX;
+    }
+    put(passes, row, sense);
+    passes = 0;
+}
+
+void trace_dump(void (*write)(const uint8_t* data, uint8_t length), uint8_t rows)
+{
+    paused = true;
+
+    struct trace_header h;
+    memcpy(h.magic, "KTRC", 4);
+    h.version = TRACE_VERSION;
+    h.rows = rows;
+    h.count = count;
+    write((const uint8_t*) &h, sizeof(h));
+
+    /* Nothing else touches the ring while it's paused. */
+
+    uint16_t i = (head + TRACE_ENTRIES - count) % TRACE_ENTRIES;
+    uint16_t left = count;
+    while (left)
+    {
+        uint16_t n = TRACE_ENTRIES - i;
+        if (n > left)
+            n = left;
+        if (n > (DUMP_CHUNK / sizeof(struct trace_entry)))
+            n = DUMP_CHUNK / sizeof(struct trace_entry);
+
+        write((const uint8_t*) &ring[i], n * sizeof(struct trace_entry));
+        i = (i + n) % TRACE_ENTRIES;
+        left -= n;
+    }
+
+    paused = false;
+}
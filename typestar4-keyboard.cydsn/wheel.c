@@ -0,0 +1,79 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "project.h"
+#include "wheel.h"
+
+static struct wheel_timer* slots[WHEEL_SLOTS];
+static uint8_t now;
+
+static void remove_timer(struct wheel_timer* timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->pprev = NULL;
+}
+
+void wheel_init(struct wheel_timer* timer, wheel_callback_t* callback)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->rounds = 0;
+    timer->callback = callback;
+}
+
+void wheel_start(struct wheel_timer* timer, uint16_t ms)
+{
+    if (!ms)
+        ms = 1;
+
+    uint8_t state = CyEnterCriticalSection();
+    if (timer->pprev)
+        remove_timer(timer);
+
+    /* The next tick visits slot now+1, so the timer's slot first comes
+     * round ((ms-1) % WHEEL_SLOTS) + 1 ticks from now; rounds covers the
+     * rest. */
+
+    struct wheel_timer** slot = &slots[(now + ms) & (WHEEL_SLOTS-1)];
+    timer->rounds = (ms - 1) / WHEEL_SLOTS;
+    timer->next = *slot;
+    if (timer->next)
+        timer->next->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+    CyExitCriticalSection(state);
+}
+
+void wheel_stop(struct wheel_timer* timer)
+{
+    uint8_t state = CyEnterCriticalSection();
+    if (timer->pprev)
+        remove_timer(timer);
+    CyExitCriticalSection(state);
+}
+
+void wheel_tick(void)
+{
+    uint8_t state = CyEnterCriticalSection();
+    now = (now + 1) & (WHEEL_SLOTS-1);
+    struct wheel_timer* timer = slots[now];
+    while (timer)
+    {
+        struct wheel_timer* next = timer->next;
+        if (timer->rounds)
+            timer->rounds--;
+        else
+        {
+            remove_timer(timer);
+            timer->callback(timer);
+        }
+        timer = next;
+    }
+    CyExitCriticalSection(state);
+}
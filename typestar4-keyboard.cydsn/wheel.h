@@ -0,0 +1,42 @@
+/* typestar4-keyboard firmware
+ * (C) 2017 David Given
+ */
+
+#ifndef WHEEL_H
+#define WHEEL_H
+
+/* A hashed timer wheel, ticked once a millisecond from SysTick. A timer
+ * lives in the slot its expiry hashes to, with a count of the whole turns
+ * of the wheel still to go, so starting or stopping a timer costs the same
+ * however many are running, and each tick only looks at the timers in one
+ * slot. Callbacks run from the tick, in interrupt context, with the timer
+ * already stopped (so they can restart it), and mustn't start or stop any
+ * other timer. The tick needn't be in the scanner's context, so a callback
+ * should just set a flag for its owner to pick up. */
+
+#define WHEEL_SLOTS 32 /* must be a power of two */
+
+struct wheel_timer;
+typedef void wheel_callback_t(struct wheel_timer* timer);
+
+struct wheel_timer
+{
+    struct wheel_timer* next;
+    struct wheel_timer** pprev;     /* NULL when stopped */
+    uint16_t rounds;
+    wheel_callback_t* callback;
+};
+
+extern void wheel_init(struct wheel_timer* timer, wheel_callback_t* callback);
+
+/* Starting a running timer restarts it. These may be called from any
+ * context. */
+
+extern void wheel_start(struct wheel_timer* timer, uint16_t ms);
+extern void wheel_stop(struct wheel_timer* timer);
+
+/* Only called from SysTick, once a millisecond. */
+
+extern void wheel_tick(void);
+
+#endif